@@ -0,0 +1,384 @@
+#pragma once
+#include "MCLib.h"
+#include "Instruments.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+// Monte Carlo calibration of a models parameters to a set of quoted european calls.
+//
+// Calling the engine from an outside optimiser regenerates the gaussians and re-clones the model on every
+// objective evaluation, and prices every quote on different random numbers, which makes the objective noisy in the
+// parameters. The CalibrationPricer instead draws one fixed set of gaussians up front and keeps it in memory, so
+// every evaluation prices the whole quote set on common random numbers: the objective is smooth, finite difference
+// sensitivities on the same paths are accurate, and the only per evaluation set up is re-initialising a warm model
+// (which, thanks to the models dependency tracking, only recomputes the tables that depend on what moved).
+//
+// Any FinancialModel can be calibrated, the calibrated parameters are picked by their index in parameters().
+
+struct CalibrationQuote {
+  EuropeanCall<double> call;
+  double price;
+  double weight{1.0};
+};
+
+struct CalibrationParameter {
+  size_t index;
+  double lower{-std::numeric_limits<double>::infinity()};
+  double upper{std::numeric_limits<double>::infinity()};
+};
+
+struct CalibrationConfig {
+  size_t num_paths{50000};
+  size_t chunk_size{1024};
+  size_t max_iterations{50};
+  // stop once a step improves the weighted sum of squared errors by less than this, relative to the error
+  double tolerance{1e-12};
+  // or once the step it would take is smaller than this, relative to the parameters
+  double step_tolerance{1e-9};
+  // relative finite difference bump for the sensitivities
+  double bump{1e-4};
+};
+
+struct CalibrationResult {
+  std::vector<double> parameters;
+  std::vector<double> model_prices;
+  double rms_error{0.0};
+  size_t iterations{0};
+  // parameter sets priced, the bumped ones included
+  size_t evaluations{0};
+  double wall_seconds{0.0};
+  bool converged{false};
+};
+
+// Prices a quote set on fixed common random numbers. Several parameter sets are priced in one go, which is how
+// the Jacobian is computed: the base set and its bumps run together on the ThreadPool, one task per set and chunk
+// of paths, and each task values every quote on its paths.
+class CalibrationPricer {
+  std::vector<CalibrationQuote> quotes_;
+  CalibrationConfig config_;
+
+  // the union of what the quotes sample, every date of any quote and every forward and discount any of them
+  // needs on it. Each quote is valued by its own instrument, on its own Scenario gathered from the strip path.
+  std::vector<double> timeline_;
+  std::vector<SampleDef<double>> samples_;
+
+  struct QuoteSlot {
+    size_t date;
+    std::vector<size_t> forwards;
+    std::vector<size_t> discounts;
+  };
+  std::vector<std::vector<QuoteSlot>> quote_slots_;
+
+  std::unique_ptr<FinancialModel<double>> model_;
+  size_t dimension_;
+  std::vector<double> gaussians_;
+
+  // one warm model per parameter set, kept across evaluations
+  std::vector<std::unique_ptr<FinancialModel<double>>> models_;
+
+  std::vector<std::vector<double>> sums_;
+
+public:
+  CalibrationPricer(std::vector<CalibrationQuote> quotes, const FinancialModel<double> &model, const RNG &rng,
+                    const CalibrationConfig &config = {})
+      : quotes_(std::move(quotes)), config_(config), model_(model.clone()) {
+    if (quotes_.empty()) throw std::runtime_error("CalibrationPricer: no quotes");
+
+    for (const auto &quote : quotes_) {
+      const Instrument<double> &instrument = quote.call;
+      timeline_.insert(timeline_.end(), instrument.timeline().begin(), instrument.timeline().end());
+    }
+    std::sort(timeline_.begin(), timeline_.end());
+    timeline_.erase(std::unique(timeline_.begin(), timeline_.end()), timeline_.end());
+    samples_.resize(timeline_.size());
+
+    auto position = [](std::vector<double> &xs, const double x) {
+      auto it = std::find(xs.begin(), xs.end(), x);
+      if (it == xs.end()) it = xs.insert(it, x);
+      return static_cast<size_t>(it - xs.begin());
+    };
+    for (const auto &quote : quotes_) {
+      const Instrument<double> &instrument = quote.call;
+      std::vector<QuoteSlot> slots;
+      for (size_t k = 0; k < instrument.timeline().size(); ++k) {
+        const auto &def = instrument.samples_needed()[k];
+        QuoteSlot slot;
+        slot.date = std::lower_bound(timeline_.begin(), timeline_.end(), instrument.timeline()[k]) - timeline_.begin();
+        auto &strip = samples_[slot.date];
+        strip.numeraire = strip.numeraire || def.numeraire;
+        for (const auto t : def.forward_maturities) slot.forwards.push_back(position(strip.forward_maturities, t));
+        for (const auto t : def.discount_maturities) slot.discounts.push_back(position(strip.discount_maturities, t));
+        slots.push_back(std::move(slot));
+      }
+      quote_slots_.push_back(std::move(slots));
+    }
+
+    model_->allocate(timeline_, samples_);
+    model_->initialize(timeline_, samples_);
+    dimension_ = model_->simulation_dimension();
+
+    // the common random numbers, drawn once in path order
+    auto generator = rng.clone();
+    generator->initialize(dimension_);
+    gaussians_.resize(config_.num_paths * dimension_);
+    std::vector<double> draw(dimension_);
+    for (size_t i = 0; i < config_.num_paths; ++i) {
+      generator->get_gaussians(draw);
+      std::copy(draw.begin(), draw.end(), gaussians_.begin() + i * dimension_);
+    }
+  }
+
+  const std::vector<CalibrationQuote> &quotes() const { return quotes_; }
+
+  FinancialModel<double> &model() { return *model_; }
+
+  // prices every quote under each parameter set, a set holding the values of the parameters at indices. The
+  // parameters not in indices are those of model() as it is now.
+  std::vector<std::vector<double>> price(const std::vector<size_t> &indices,
+                                         const std::vector<std::vector<double>> &parameter_sets) {
+    const size_t number_of_sets = parameter_sets.size();
+    while (models_.size() < number_of_sets) models_.push_back(model_->clone());
+    const auto &base = model_->parameters();
+    for (size_t s = 0; s < number_of_sets; ++s) {
+      // every parameter is copied, so nothing a previous call (or bump) left in the warm model survives
+      auto &parameters = models_[s]->parameters();
+      for (size_t p = 0; p < base.size(); ++p) *parameters[p] = *base[p];
+      for (size_t p = 0; p < indices.size(); ++p) *parameters[indices[p]] = parameter_sets[s][p];
+      models_[s]->allocate(timeline_, samples_);
+      models_[s]->initialize(timeline_, samples_);
+    }
+
+    const size_t chunk_size = std::max<size_t>(config_.chunk_size, 1);
+    const size_t number_of_chunks = (config_.num_paths + chunk_size - 1) / chunk_size;
+    const size_t m = quotes_.size();
+    sums_.assign(number_of_sets * number_of_chunks, std::vector<double>(m, 0.0));
+
+    ThreadPool *pool = ThreadPool::get_instance();
+    pool->start();
+    struct ThreadScratch {
+      std::vector<double> gaussian_vector;
+      Scenario<double> path;
+      std::vector<Scenario<double>> quote_paths;
+      std::vector<double> payoffs;
+    };
+    std::vector<std::unique_ptr<ThreadScratch>> scratch(pool->number_of_threads() + 1);
+
+    auto task = [&](const size_t k) {
+      const size_t set = k / number_of_chunks;
+      const size_t chunk = k % number_of_chunks;
+      auto &mine = scratch[pool->thread_number()];
+      if (!mine) {
+        mine = std::make_unique<ThreadScratch>();
+        mine->gaussian_vector.resize(dimension_);
+        allocate_path(samples_, mine->path);
+        initialize_path(mine->path);
+        mine->quote_paths.resize(m);
+        size_t most_payoffs = 1;
+        for (size_t q = 0; q < m; ++q) {
+          const Instrument<double> &instrument = quotes_[q].call;
+          allocate_path(instrument.samples_needed(), mine->quote_paths[q]);
+          initialize_path(mine->quote_paths[q]);
+          most_payoffs = std::max<size_t>(most_payoffs, instrument.number_of_payoffs());
+        }
+        mine->payoffs.resize(most_payoffs);
+      }
+
+      auto &sum = sums_[k];
+      const size_t last = std::min(config_.num_paths, (chunk + 1) * chunk_size);
+      for (size_t i = chunk * chunk_size; i < last; ++i) {
+        std::copy(gaussians_.begin() + i * dimension_, gaussians_.begin() + (i + 1) * dimension_,
+                  mine->gaussian_vector.begin());
+        models_[set]->generate_path(mine->gaussian_vector, mine->path);
+        // each quote is priced by its instrument, its quoted price is that of the first payoff
+        for (size_t q = 0; q < m; ++q) {
+          auto &quote_path = mine->quote_paths[q];
+          for (size_t j = 0; j < quote_path.size(); ++j) {
+            const auto &slot = quote_slots_[q][j];
+            const auto &sample = mine->path[slot.date];
+            quote_path[j].numeraire = sample.numeraire;
+            for (size_t f = 0; f < slot.forwards.size(); ++f)
+              quote_path[j].forwards[f] = sample.forwards[slot.forwards[f]];
+            for (size_t d = 0; d < slot.discounts.size(); ++d)
+              quote_path[j].discounts[d] = sample.discounts[slot.discounts[d]];
+          }
+          quotes_[q].call.payoffs(quote_path, mine->payoffs);
+          sum[q] += mine->payoffs[0];
+        }
+      }
+    };
+
+    TaskLatch done;
+    pool->spawn_bulk(number_of_sets * number_of_chunks, task, done);
+    pool->wait(done);
+
+    // chunks are combined in order, so the prices don't depend on which thread ran what
+    std::vector<std::vector<double>> prices(number_of_sets, std::vector<double>(m, 0.0));
+    for (size_t s = 0; s < number_of_sets; ++s) {
+      for (size_t c = 0; c < number_of_chunks; ++c)
+        for (size_t q = 0; q < m; ++q) prices[s][q] += sums_[s * number_of_chunks + c][q];
+      for (auto &price : prices[s]) price /= config_.num_paths;
+    }
+    return prices;
+  }
+};
+
+namespace calibration_detail {
+
+// solves the small dense system a x = b by gaussian elimination with partial pivoting, a is overwritten
+inline std::vector<double> solve(std::vector<std::vector<double>> a, std::vector<double> b) {
+  const size_t n = b.size();
+  for (size_t col = 0; col < n; ++col) {
+    size_t pivot = col;
+    for (size_t row = col + 1; row < n; ++row)
+      if (std::abs(a[row][col]) > std::abs(a[pivot][col])) pivot = row;
+    std::swap(a[col], a[pivot]);
+    std::swap(b[col], b[pivot]);
+    if (a[col][col] == 0.0) throw std::runtime_error("calibrate: singular normal equations");
+    for (size_t row = col + 1; row < n; ++row) {
+      const double factor = a[row][col] / a[col][col];
+      for (size_t k = col; k < n; ++k) a[row][k] -= factor * a[col][k];
+      b[row] -= factor * b[col];
+    }
+  }
+  std::vector<double> x(n);
+  for (size_t row = n; row-- > 0;) {
+    double acc = b[row];
+    for (size_t k = row + 1; k < n; ++k) acc -= a[row][k] * x[k];
+    x[row] = acc / a[row][row];
+  }
+  return x;
+}
+
+} // namespace calibration_detail
+
+// Levenberg-Marquardt on the weighted price errors, starting from the models current parameter values. Every
+// priced point is priced together with its bumps, so an accepted step already has its Jacobian and each iteration
+// costs a single parallel pricing of 1 + number of parameters sets.
+inline CalibrationResult calibrate(CalibrationPricer &pricer, const std::vector<CalibrationParameter> &parameters,
+                                   const CalibrationConfig &config = {}) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto &quotes = pricer.quotes();
+  const size_t n = parameters.size();
+  const size_t m = quotes.size();
+
+  std::vector<size_t> indices;
+  for (const auto &parameter : parameters) indices.push_back(parameter.index);
+
+  auto clamp = [&](std::vector<double> x) {
+    for (size_t p = 0; p < n; ++p) x[p] = std::min(std::max(x[p], parameters[p].lower), parameters[p].upper);
+    return x;
+  };
+
+  // prices x and its bumps, and turns them into weighted residuals, their jacobian and the squared error
+  struct Point {
+    std::vector<double> x;
+    std::vector<double> prices;
+    std::vector<double> residuals;
+    std::vector<std::vector<double>> jacobian;
+    double error{0.0};
+  };
+  CalibrationResult result;
+  auto evaluate = [&](const std::vector<double> &x) {
+    std::vector<std::vector<double>> sets{x};
+    std::vector<double> steps(n);
+    for (size_t p = 0; p < n; ++p) {
+      steps[p] = config.bump * std::max(std::abs(x[p]), 1e-2);
+      // bump downwards when the upper bound is in the way
+      if (x[p] + steps[p] > parameters[p].upper) steps[p] = -steps[p];
+      sets.push_back(x);
+      sets.back()[p] += steps[p];
+    }
+    const auto prices = pricer.price(indices, sets);
+    result.evaluations += sets.size();
+
+    Point point;
+    point.x = x;
+    point.prices = prices[0];
+    point.residuals.resize(m);
+    point.jacobian.assign(m, std::vector<double>(n));
+    for (size_t q = 0; q < m; ++q) {
+      point.residuals[q] = quotes[q].weight * (prices[0][q] - quotes[q].price);
+      point.error += point.residuals[q] * point.residuals[q];
+      for (size_t p = 0; p < n; ++p)
+        point.jacobian[q][p] = quotes[q].weight * (prices[p + 1][q] - prices[0][q]) / steps[p];
+    }
+    return point;
+  };
+
+  std::vector<double> x0;
+  auto &model_parameters = pricer.model().parameters();
+  for (const auto index : indices) x0.push_back(*model_parameters[index]);
+  Point current = evaluate(clamp(x0));
+
+  double lambda = 1e-3;
+  while (result.iterations < config.max_iterations && current.error > 0.0) {
+    ++result.iterations;
+
+    // the damped normal equations (J'J + lambda diag(J'J)) step = -J'r
+    std::vector<std::vector<double>> normal(n, std::vector<double>(n, 0.0));
+    std::vector<double> gradient(n, 0.0);
+    for (size_t q = 0; q < m; ++q) {
+      for (size_t i = 0; i < n; ++i) {
+        gradient[i] -= current.jacobian[q][i] * current.residuals[q];
+        for (size_t j = 0; j < n; ++j) normal[i][j] += current.jacobian[q][i] * current.jacobian[q][j];
+      }
+    }
+    for (size_t i = 0; i < n; ++i) normal[i][i] += lambda * std::max(normal[i][i], 1e-300);
+
+    const auto step = calibration_detail::solve(normal, gradient);
+    std::vector<double> x = current.x;
+    for (size_t p = 0; p < n; ++p) x[p] += step[p];
+    const auto relative_step = [&](const std::vector<double> &y) {
+      double largest = 0.0;
+      for (size_t p = 0; p < n; ++p)
+        largest = std::max(largest, std::abs(y[p] - current.x[p]) / std::max(std::abs(current.x[p]), 1e-2));
+      return largest;
+    };
+    if (relative_step(x) < config.step_tolerance) {
+      result.converged = true;
+      break;
+    }
+    // the step wants to go further out of the box than we already are, the bounds leave nowhere to go
+    x = clamp(x);
+    if (relative_step(x) < config.step_tolerance) break;
+    Point trial = evaluate(x);
+
+    if (trial.error < current.error) {
+      const bool small = current.error - trial.error <= config.tolerance * current.error;
+      current = std::move(trial);
+      lambda = std::max(lambda / 3.0, 1e-12);
+      if (small) {
+        result.converged = true;
+        break;
+      }
+    } else {
+      lambda *= 3.0;
+      // the steps keep failing, give up without claiming we found the minimum
+      if (lambda > 1e12) break;
+    }
+  }
+  if (current.error == 0.0) result.converged = true;
+
+  // leave the pricers model at the calibrated values
+  for (size_t p = 0; p < n; ++p) *model_parameters[indices[p]] = current.x[p];
+
+  result.parameters = current.x;
+  result.model_prices = current.prices;
+  result.rms_error = std::sqrt(current.error / m);
+  result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+// convenience overload that builds the pricer, and the common random numbers, for a single calibration
+inline CalibrationResult calibrate(std::vector<CalibrationQuote> quotes, const FinancialModel<double> &model,
+                                   const RNG &rng, const std::vector<CalibrationParameter> &parameters,
+                                   const CalibrationConfig &config = {}) {
+  const auto start = std::chrono::steady_clock::now();
+  CalibrationPricer pricer(std::move(quotes), model, rng, config);
+  auto result = calibrate(pricer, parameters, config);
+  result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
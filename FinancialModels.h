@@ -1,6 +1,7 @@
 #pragma once
 #include "MCLib.h"
 #include <cmath>
+#include <limits>
 
 // class is defined generically over the number type so that later on we can
 // implement autodiff for the greeks
@@ -17,14 +18,21 @@ template <typename T> class BlackScholesModel : public FinancialModel<T> {
   // we make our parameters available for others to tinker with later, specifically to compute the greeks
   std::vector<T *> parameters_;
 
-  // These vectors compute the drift and std up to time t on the timeline, for each t on the timeline
-  std::vector<T> underlying_drifts_;
-  std::vector<T> underlying_stds_;
+  struct Tables {
+    // These vectors compute the drift and std up to time t on the timeline, for each t on the timeline
+    std::vector<T> underlying_drifts;
+    std::vector<T> underlying_stds;
 
-  // for each time in the timeline we have a numeraire, forward rate, and discount factor
-  std::vector<T> numeraires_;
-  std::vector<std::vector<T>> forward_factors_;
-  std::vector<std::vector<T>> discount_factors_;
+    // for each time in the timeline we have a numeraire, forward rate, and discount factor
+    std::vector<T> numeraires;
+    std::vector<std::vector<T>> forward_factors;
+    std::vector<std::vector<T>> discount_factors;
+  };
+
+  // the tables for the trade and parameters we were last initialized for, out of a cache shared with our clones.
+  // The cache is keyed on vol/rate/div only, nothing we precompute depends on spot, so spot moves are always hits
+  std::shared_ptr<ModelTableCache<T, Tables>> table_cache_{std::make_shared<ModelTableCache<T, Tables>>()};
+  std::shared_ptr<const Tables> tables_;
 
 public:
   template <typename U>
@@ -55,6 +63,14 @@ public:
     return parameters_;
   }
 
+  void append_key(PricingKey& key) const override {
+    key.add("BlackScholes");
+    key.add(static_cast<double>(spot_));
+    key.add(static_cast<double>(vol_));
+    key.add(static_cast<double>(rate_));
+    key.add(static_cast<double>(div_));
+  }
+
 
 private:
   void set_parameter_pointers(){
@@ -72,59 +88,77 @@ public:
     return clone;
   }
 
-  // in order to allocate we need to calculate the sizes needed for the vectors/matricies and reserve that much space
+  // the tables are sized and filled by initialize, all we need here is the simulation timeline
   void allocate(const std::vector<double>& instrument_timeline, const std::vector<SampleDef<T>>& samples_needed) override {
     timeline_.clear();
     timeline_.push_back(0.0);
     for(const auto& time : instrument_timeline) if(time > 0.0) timeline_.push_back(time);
 
     samples_needed_ = &samples_needed;
-    underlying_drifts_.resize(timeline_.size() - 1);
-    underlying_stds_.resize(timeline_.size() - 1);
-
-    const size_t n = instrument_timeline.size();
-    numeraires_.resize(n);
-    discount_factors_.resize(n);
-    for(auto j = 0; j < n; ++j){
-        discount_factors_[j].resize(samples_needed[j].discount_maturities.size());
-    }
-    
-    forward_factors_.resize(n);
-    for(auto j = 0; j < n; ++j){
-        forward_factors_[j].resize(samples_needed[j].forward_maturities.size());
-    }
+    tables_.reset();
   }
 
-  // to initialize we pre compute the drifts and std, and then use them to compute forward and discounts
+  // to initialize we pre compute the drifts and std, and then use them to compute forward and discounts. Tables
+  // already built for this trade and these parameters come straight out of the cache, otherwise we start from
+  // the ones of the same trade that were used last and only rebuild those depending on a parameter that moved
   void initialize(const std::vector<double>& instrument_timeline, const std::vector<SampleDef<T>>& samples_needed) override {
-    // We want to precompute everything that does not rely on the simulation
-    const T mu = rate_ - div_;
+    samples_needed_ = &samples_needed;
+    tables_ = table_cache_->find_or_build(instrument_timeline, samples_needed, {vol_, rate_, div_},
+                                          [&](const Tables* nearest, const std::vector<T>* was, size_t& recomputes){
+      Tables tables;
+      if(nearest) tables = *nearest;
+      const bool vol_moved = !nearest || vol_ != (*was)[0];
+      const bool rate_moved = !nearest || rate_ != (*was)[1];
+      const bool div_moved = !nearest || div_ != (*was)[2];
 
-    // pre compute the drifts and devs 
-    const size_t n = timeline_.size() - 1;
-    for(auto i = 0; i < n; ++i){
-        const double dt = timeline_[i+1] - timeline_[i];
-        underlying_stds_[i] = vol_ * std::sqrt(dt);
-        underlying_drifts_[i] = (mu - 0.5 * vol_ * vol_)*dt;
-    }
+      // We want to precompute everything that does not rely on the simulation
+      const T mu = rate_ - div_;
 
-    // pre compute the forward and discount rates
-    const size_t m = instrument_timeline.size();
-    for(auto i = 0; i < m; ++i){
-        if(samples_needed[i].numeraire){
-            numeraires_[i] = std::exp(rate_ * instrument_timeline[i]);
-        }
+      // pre compute the drifts and devs, the drifts need vol/rate/div but the devs only need vol
+      const size_t n = timeline_.size() - 1;
+      tables.underlying_drifts.resize(n);
+      tables.underlying_stds.resize(n);
+      for(size_t i = 0; i < n; ++i){
+          const double dt = timeline_[i+1] - timeline_[i];
+          if(vol_moved) tables.underlying_stds[i] = vol_ * std::sqrt(dt);
+          tables.underlying_drifts[i] = (mu - 0.5 * vol_ * vol_)*dt;
+      }
+      recomputes += vol_moved ? 2 : 1;
 
-        const size_t nFF = samples_needed[i].forward_maturities.size();
-        for(auto j = 0; j < nFF; ++j){
-            forward_factors_[i][j] = std::exp(mu * (samples_needed[i].forward_maturities[j] - instrument_timeline[i]));
-        }
+      // pre compute the forward and discount rates, numeraires and discounts only need the rate
+      const size_t m = instrument_timeline.size();
+      tables.numeraires.resize(m);
+      tables.forward_factors.resize(m);
+      tables.discount_factors.resize(m);
+      for(size_t i = 0; i < m; ++i){
+          if(rate_moved && samples_needed[i].numeraire){
+              tables.numeraires[i] = std::exp(rate_ * instrument_timeline[i]);
+          }
 
-        const size_t nDF = samples_needed[i].discount_maturities.size();
-        for(auto j = 0; j < nDF; ++j){
-            discount_factors_[i][j] = std::exp(-rate_ * (samples_needed[i].discount_maturities[j] - instrument_timeline[i]));
-        }
-    }
+          if(rate_moved || div_moved){
+            const size_t nFF = samples_needed[i].forward_maturities.size();
+            tables.forward_factors[i].resize(nFF);
+            for(size_t j = 0; j < nFF; ++j){
+                tables.forward_factors[i][j] = std::exp(mu * (samples_needed[i].forward_maturities[j] - instrument_timeline[i]));
+            }
+          }
+
+          if(rate_moved){
+            const size_t nDF = samples_needed[i].discount_maturities.size();
+            tables.discount_factors[i].resize(nDF);
+            for(size_t j = 0; j < nDF; ++j){
+                tables.discount_factors[i][j] = std::exp(-rate_ * (samples_needed[i].discount_maturities[j] - instrument_timeline[i]));
+            }
+          }
+      }
+      recomputes += (rate_moved ? 2 : 0) + (rate_moved || div_moved ? 1 : 0);
+      return tables;
+    });
+  }
+
+  // how often the tables were found warm, and how many of them had to be rebuilt, across this model and its clones
+  const ModelTableCache<T, Tables>& table_cache() const {
+    return *table_cache_;
   }
 
   size_t simulation_dimension() const override {
@@ -133,15 +167,15 @@ public:
 
 private:
   // given a scenario we populate its forward and discount factors
-  inline void fillScen(const size_t idx, const T& spot, MarketSample<T>& sample, const SampleDef<T>& def) const {
+  inline void fillScen(const Tables& tables, const size_t idx, const T& spot, MarketSample<T>& sample, const SampleDef<T>& def) const {
     if(def.numeraire){
-        sample.numeraire = numeraires_[idx];
+        sample.numeraire = tables.numeraires[idx];
     }
 
-    std::transform(forward_factors_[idx].begin(), forward_factors_[idx].end(), sample.forwards.begin(), 
+    std::transform(tables.forward_factors[idx].begin(), tables.forward_factors[idx].end(), sample.forwards.begin(), 
                         [&spot](const T& ff){return spot * ff;});
 
-    std::copy(discount_factors_[idx].begin(), discount_factors_[idx].end(), sample.discounts.begin());
+    std::copy(tables.discount_factors[idx].begin(), tables.discount_factors[idx].end(), sample.discounts.begin());
   }
 
 public:
@@ -149,12 +183,328 @@ public:
   // events needed for the instrument to compute its payoff
   void generate_path(const std::vector<double>& gaussian_vector, Scenario<T>& path) const override {
     T spot = spot_;
+    const Tables& tables = *tables_;
 
+    const size_t n = timeline_.size() - 1;
+    for(size_t i = 0; i < n; ++i){
+        spot = spot * std::exp(tables.underlying_drifts[i]+ tables.underlying_stds[i] * gaussian_vector[i]);
+        fillScen(tables, i, spot, path[i], (*samples_needed_)[i]);
+    }
+  }
 
+  // same path, one date at a time into a single sample. The growth factors are computed in a pass of their own
+  // first, which keeps the exps independent of the observers calls in between dates
+  void stream_path(const std::vector<double>& gaussian_vector, MarketSample<T>& sample, SampleObserver<T>& observer) const override {
     const size_t n = timeline_.size() - 1;
-    for(auto i = 0; i < n; ++i){
-        spot = spot * std::exp(underlying_drifts_[i]+ underlying_stds_[i] * gaussian_vector[i]);
-        fillScen(i, spot, path[i], (*samples_needed_)[i]);
+    const Tables& tables = *tables_;
+    thread_local std::vector<T> growth;
+    growth.resize(n);
+    for(size_t i = 0; i < n; ++i){
+        growth[i] = std::exp(tables.underlying_drifts[i]+ tables.underlying_stds[i] * gaussian_vector[i]);
+    }
+
+    T spot = spot_;
+    for(size_t i = 0; i < n; ++i){
+        spot = spot * growth[i];
+        sample.allocate((*samples_needed_)[i]);
+        fillScen(tables, i, spot, sample, (*samples_needed_)[i]);
+        observer.observe(i, sample);
     }
   }
-};
\ No newline at end of file
+};
+
+namespace merton_detail {
+
+// the inverse of the standard normal cdf, Wichura's algorithm AS241 which is good to about 1e-16 over the whole
+// range. We only use it while initializing, to turn poisson probabilities into gaussian thresholds
+inline double inverse_normal_cdf(const double p) {
+  const double q = p - 0.5;
+  if (std::abs(q) <= 0.425) {
+    const double r = 0.180625 - q * q;
+    return q *
+           (((((((2509.0809287301226727 * r + 33430.575583588128105) * r + 67265.770927008700853) * r +
+                45921.953931549871457) * r + 13731.693765509461125) * r + 1971.5909503065514427) * r +
+             133.14166789178437745) * r + 3.387132872796366608) /
+           (((((((5226.495278852545925 * r + 28729.085735721942674) * r + 39307.89580009271061) * r +
+                21213.794301586595867) * r + 5394.1960214247511077) * r + 687.1870074920579083) * r +
+             42.313330701600911252) * r + 1.0);
+  }
+
+  double r = std::sqrt(-std::log(q < 0.0 ? p : 1.0 - p));
+  double value;
+  if (r <= 5.0) {
+    r -= 1.6;
+    value = (((((((7.7454501427834140764e-4 * r + 0.0227238449892691845833) * r + 0.24178072517745061177) * r +
+                 1.27045825245236838258) * r + 3.64784832476320460504) * r + 5.7694972214606914055) * r +
+              4.6303378461565452959) * r + 1.42343711074968357734) /
+            (((((((1.05075007164441684324e-9 * r + 5.475938084995344946e-4) * r + 0.0151986665636164571966) * r +
+                 0.14810397642748007459) * r + 0.68976733498510000455) * r + 1.6763848301838038494) * r +
+              2.05319162663775882187) * r + 1.0);
+  } else {
+    r -= 5.0;
+    value = (((((((2.01033439929228813265e-7 * r + 2.71155556874348757815e-5) * r + 0.0012426609473880784386) * r +
+                 0.026532189526576123093) * r + 0.29656057182850489123) * r + 1.7848265399172913358) * r +
+              5.4637849111641143699) * r + 6.6579046435011037772) /
+            (((((((2.04426310338993978564e-15 * r + 1.4215117583164458887e-7) * r + 1.8463183175100546818e-5) * r +
+                 7.868691311456132591e-4) * r + 0.0148753612908506148525) * r + 0.13692988092273580531) * r +
+              0.59983220655588793769) * r + 1.0);
+  }
+  return q < 0.0 ? -value : value;
+}
+
+// gaussian thresholds for a poisson count with mean lambda_dt: a standard gaussian z gives k jumps when it lies
+// above exactly k of them, which is the inverse cdf method with u = N(z). Counts whose tail probability is below
+// anything a double gaussian can reach are dropped
+inline std::vector<double> poisson_thresholds(const double lambda_dt) {
+  std::vector<double> thresholds;
+  if (!(lambda_dt > 0.0)) return thresholds;
+
+  std::vector<double> pmf;
+  for (size_t k = 0;; ++k) {
+    pmf.push_back(std::exp(-lambda_dt + k * std::log(lambda_dt) - std::lgamma(k + 1.0)));
+    if (k > lambda_dt && pmf.back() < 1e-20) break;
+  }
+
+  // P(N > k) summed from the far end so that the small tails don't suffer from cancellation
+  std::vector<double> tails(pmf.size());
+  double tail = 0.0;
+  for (size_t k = pmf.size(); k-- > 0;) {
+    tails[k] = tail;
+    tail += pmf[k];
+  }
+
+  for (size_t k = 0; k < tails.size() && tails[k] >= 1e-18; ++k) thresholds.push_back(-inverse_normal_cdf(tails[k]));
+  return thresholds;
+}
+
+} // namespace merton_detail
+
+// Merton's jump diffusion, black scholes plus a compound poisson process of lognormal jumps: jumps arrive with
+// the given intensity and each one multiplies the spot by exp(N(jump_mean, jump_vol^2)). The drift is compensated
+// for the jumps so forwards are the same as under black scholes.
+//
+// Every step consumes three gaussians, laid out as n diffusion draws, then n jump count draws, then n jump size
+// draws. The count comes from comparing its gaussian against precomputed poisson thresholds, and the sum of k
+// lognormal jump sizes is exactly k * jump_mean + sqrt(k) * jump_vol * z, so the rng interface stays gaussian only
+// and antithetic sampling and jump_ahead keep working unchanged.
+template <typename T> class MertonJumpModel : public FinancialModel<T> {
+  T spot_;
+  T vol_;
+  T rate_;
+  T div_;
+  T intensity_;
+  T jump_mean_;
+  T jump_vol_;
+
+  std::vector<double> timeline_;
+  const std::vector<SampleDef<T>> *samples_needed_;
+
+  std::vector<T *> parameters_;
+
+  struct Tables {
+    // compensated diffusion drifts and stds per step
+    std::vector<T> underlying_drifts;
+    std::vector<T> underlying_stds;
+
+    // per step poisson thresholds, and the first of them on its own so the no jump check is a single flat scan.
+    // A step that can't jump has an infinite first threshold
+    std::vector<std::vector<double>> jump_thresholds;
+    std::vector<double> first_jump_thresholds;
+
+    std::vector<T> numeraires;
+    std::vector<std::vector<T>> forward_factors;
+    std::vector<std::vector<T>> discount_factors;
+  };
+
+  // the same table cache, shared with our clones, as the black scholes model. Keyed on every parameter but spot
+  std::shared_ptr<ModelTableCache<T, Tables>> table_cache_{std::make_shared<ModelTableCache<T, Tables>>()};
+  std::shared_ptr<const Tables> tables_;
+
+public:
+  template <typename U>
+  MertonJumpModel(const U spot, const U vol, const U rate, const U div, const U intensity, const U jump_mean,
+                  const U jump_vol)
+      : spot_(spot), vol_(vol), rate_(rate), div_(div), intensity_(intensity), jump_mean_(jump_mean),
+        jump_vol_(jump_vol), parameters_(7) {
+    set_parameter_pointers();
+  }
+
+  T spot() const { return spot_; }
+  const T vol() const { return vol_; }
+  const T rate() const { return rate_; }
+  const T div() const { return div_; }
+  const T intensity() const { return intensity_; }
+  const T jump_mean() const { return jump_mean_; }
+  const T jump_vol() const { return jump_vol_; }
+
+  // the first four line up with the black scholes parameters
+  const std::vector<T *> &parameters() override { return parameters_; }
+
+  void append_key(PricingKey &key) const override {
+    key.add("MertonJump");
+    for (const T *parameter : parameters_) key.add(static_cast<double>(*parameter));
+  }
+
+private:
+  void set_parameter_pointers() {
+    parameters_[0] = &spot_;
+    parameters_[1] = &vol_;
+    parameters_[2] = &rate_;
+    parameters_[3] = &div_;
+    parameters_[4] = &intensity_;
+    parameters_[5] = &jump_mean_;
+    parameters_[6] = &jump_vol_;
+  }
+
+public:
+  std::unique_ptr<FinancialModel<T>> clone() const override {
+    auto clone = std::make_unique<MertonJumpModel<T>>(*this);
+    clone->set_parameter_pointers();
+    return clone;
+  }
+
+  void allocate(const std::vector<double> &instrument_timeline,
+                const std::vector<SampleDef<T>> &samples_needed) override {
+    timeline_.clear();
+    timeline_.push_back(0.0);
+    for (const auto &time : instrument_timeline) if (time > 0.0) timeline_.push_back(time);
+
+    samples_needed_ = &samples_needed;
+    tables_.reset();
+  }
+
+  // the jump compensation goes into the drifts, which is why they depend on every parameter but spot. The
+  // poisson thresholds only need the intensity, and the forwards, numeraires and discounts are the black scholes ones
+  void initialize(const std::vector<double> &instrument_timeline,
+                  const std::vector<SampleDef<T>> &samples_needed) override {
+    samples_needed_ = &samples_needed;
+    const std::vector<T> key{vol_, rate_, div_, intensity_, jump_mean_, jump_vol_};
+    tables_ = table_cache_->find_or_build(instrument_timeline, samples_needed, key,
+                                          [&](const Tables *nearest, const std::vector<T> *was, size_t &recomputes) {
+      Tables tables;
+      if (nearest) tables = *nearest;
+      const bool vol_moved = !nearest || vol_ != (*was)[0];
+      const bool rate_moved = !nearest || rate_ != (*was)[1];
+      const bool div_moved = !nearest || div_ != (*was)[2];
+      const bool intensity_moved = !nearest || intensity_ != (*was)[3];
+
+      const T mu = rate_ - div_;
+      const T compensator = intensity_ * (std::exp(jump_mean_ + 0.5 * jump_vol_ * jump_vol_) - 1.0);
+
+      const size_t n = timeline_.size() - 1;
+      tables.underlying_drifts.resize(n);
+      tables.underlying_stds.resize(n);
+      tables.jump_thresholds.resize(n);
+      tables.first_jump_thresholds.resize(n);
+      for (size_t i = 0; i < n; ++i) {
+        const double dt = timeline_[i + 1] - timeline_[i];
+        if (vol_moved) tables.underlying_stds[i] = vol_ * std::sqrt(dt);
+        tables.underlying_drifts[i] = (mu - compensator - 0.5 * vol_ * vol_) * dt;
+        if (intensity_moved) {
+          tables.jump_thresholds[i] = merton_detail::poisson_thresholds(static_cast<double>(intensity_) * dt);
+          tables.first_jump_thresholds[i] = tables.jump_thresholds[i].empty() ? std::numeric_limits<double>::infinity()
+                                                                             : tables.jump_thresholds[i][0];
+        }
+      }
+      recomputes += 1 + (vol_moved ? 1 : 0) + (intensity_moved ? 1 : 0);
+
+      const size_t m = instrument_timeline.size();
+      tables.numeraires.resize(m);
+      tables.forward_factors.resize(m);
+      tables.discount_factors.resize(m);
+      for (size_t i = 0; i < m; ++i) {
+        if (rate_moved && samples_needed[i].numeraire) tables.numeraires[i] = std::exp(rate_ * instrument_timeline[i]);
+
+        if (rate_moved || div_moved) {
+          const size_t nFF = samples_needed[i].forward_maturities.size();
+          tables.forward_factors[i].resize(nFF);
+          for (size_t j = 0; j < nFF; ++j)
+            tables.forward_factors[i][j] =
+                std::exp(mu * (samples_needed[i].forward_maturities[j] - instrument_timeline[i]));
+        }
+
+        if (rate_moved) {
+          const size_t nDF = samples_needed[i].discount_maturities.size();
+          tables.discount_factors[i].resize(nDF);
+          for (size_t j = 0; j < nDF; ++j)
+            tables.discount_factors[i][j] =
+                std::exp(-rate_ * (samples_needed[i].discount_maturities[j] - instrument_timeline[i]));
+        }
+      }
+      recomputes += (rate_moved ? 2 : 0) + (rate_moved || div_moved ? 1 : 0);
+      return tables;
+    });
+  }
+
+  const ModelTableCache<T, Tables> &table_cache() const { return *table_cache_; }
+
+  size_t simulation_dimension() const override { return 3 * (timeline_.size() - 1); }
+
+private:
+  inline void fillScen(const Tables &tables, const size_t idx, const T &spot, MarketSample<T> &sample,
+                       const SampleDef<T> &def) const {
+    if (def.numeraire) sample.numeraire = tables.numeraires[idx];
+
+    std::transform(tables.forward_factors[idx].begin(), tables.forward_factors[idx].end(), sample.forwards.begin(),
+                   [&spot](const T &ff) { return spot * ff; });
+
+    std::copy(tables.discount_factors[idx].begin(), tables.discount_factors[idx].end(), sample.discounts.begin());
+  }
+
+  // simulates the spot on every date and hands it to emit(tables, date, spot), shared by generate_path and
+  // stream_path
+  template <typename Emit>
+  void simulate(const std::vector<double> &gaussian_vector, Emit &&emit) const {
+    const Tables &tables = *tables_;
+    const auto &underlying_drifts = tables.underlying_drifts;
+    const auto &underlying_stds = tables.underlying_stds;
+    const auto &first_jump_thresholds = tables.first_jump_thresholds;
+    const size_t n = timeline_.size() - 1;
+    const double *diffusions = gaussian_vector.data();
+    const double *counts = diffusions + n;
+    const double *sizes = counts + n;
+
+    // most paths don't jump at all, which one branch free pass over the count draws tells us up front. Paths that
+    // do jump still take the per step fast path below, a step only searches its thresholds when its own count
+    // draw crosses the first one
+    bool jumps = false;
+    for (size_t i = 0; i < n; ++i) jumps = jumps | (counts[i] > first_jump_thresholds[i]);
+
+    T spot = spot_;
+    if (!jumps) {
+      for (size_t i = 0; i < n; ++i) {
+        spot = spot * std::exp(underlying_drifts[i] + underlying_stds[i] * diffusions[i]);
+        emit(tables, i, spot);
+      }
+      return;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      T log_return = underlying_drifts[i] + underlying_stds[i] * diffusions[i];
+      if (counts[i] > first_jump_thresholds[i]) {
+        const auto &thresholds = tables.jump_thresholds[i];
+        size_t k = 1;
+        while (k < thresholds.size() && counts[i] > thresholds[k]) ++k;
+        log_return = log_return + static_cast<double>(k) * jump_mean_ + std::sqrt(static_cast<double>(k)) * jump_vol_ * sizes[i];
+      }
+      spot = spot * std::exp(log_return);
+      emit(tables, i, spot);
+    }
+  }
+
+public:
+  void generate_path(const std::vector<double> &gaussian_vector, Scenario<T> &path) const override {
+    simulate(gaussian_vector, [&](const Tables &tables, const size_t i, const T &spot) {
+      fillScen(tables, i, spot, path[i], (*samples_needed_)[i]);
+    });
+  }
+
+  void stream_path(const std::vector<double> &gaussian_vector, MarketSample<T> &sample,
+                   SampleObserver<T> &observer) const override {
+    simulate(gaussian_vector, [&](const Tables &tables, const size_t i, const T &spot) {
+      sample.allocate((*samples_needed_)[i]);
+      fillScen(tables, i, spot, sample, (*samples_needed_)[i]);
+      observer.observe(i, sample);
+    });
+  }
+};
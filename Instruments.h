@@ -1,5 +1,8 @@
 #pragma once
 #include "MCLib.h"
+#include <cmath>
+#include <limits>
+#include <stdexcept>
 
 template <typename T>
 class EuropeanCall : public Instrument<T>{
@@ -24,6 +27,14 @@ public:
         return std::make_unique<EuropeanCall<T>>(*this);
     }
 
+    double strike() const {
+        return strike_;
+    }
+
+    double expiration() const {
+        return expiration_;
+    }
+
 
     const std::vector<double>& timeline() const override {
         return my_timeline_;
@@ -33,13 +44,21 @@ public:
         return samples_;
     }
 
-    const size_t number_of_payoffs() const override {
+    size_t number_of_payoffs() const override {
         return num_payoffs_;
     }
 
     void payoffs(const Scenario<T> &path, std::vector<T> &payoffs) const override {
         payoffs[0] = std::max(path[0].forwards[0] - strike_, 0.0) * path[0].discounts[0] / path[0].numeraire;
     }
+
+    void append_key(PricingKey &key) const override {
+        key.add("EuropeanCall");
+        key.add(strike_);
+        key.add(expiration_);
+        key.add(my_timeline_);
+        for(const auto& def : samples_) key.add(def);
+    }
 };
 
 template <typename T>
@@ -51,4 +70,199 @@ class UpAndOutCall : public Instrument<T>{
     double smoothing_factor_;
     std::vector<double> timeline_;
     std::vector<double> samples_needed_;
-};
\ No newline at end of file
+};
+
+// Common plumbing for the streaming path dependent products below. They observe the spot on a set of monitoring
+// dates and pay at the last one, so every date samples the forward to itself and the last date its numeraire.
+template <typename T>
+class MonitoredInstrument : public StreamingInstrument<T>{
+protected:
+    std::vector<double> my_timeline_;
+    std::vector<SampleDef<T>> samples_;
+
+    explicit MonitoredInstrument(std::vector<double> dates, const size_t minimum_dates = 1): my_timeline_(std::move(dates)) {
+        if(my_timeline_.size() < minimum_dates) throw std::runtime_error("not enough monitoring dates");
+        for(size_t i = 0; i < my_timeline_.size(); ++i){
+            // the models only simulate dates after today
+            if(my_timeline_[i] <= 0.0 || (i > 0 && my_timeline_[i] <= my_timeline_[i - 1]))
+                throw std::runtime_error("monitoring dates must be positive and increasing");
+        }
+        samples_.resize(my_timeline_.size());
+        for(size_t i = 0; i < my_timeline_.size(); ++i) samples_[i].forward_maturities.push_back(my_timeline_[i]);
+        samples_.back().numeraire = true;
+    }
+
+    bool last(const size_t date) const {
+        return date + 1 == my_timeline_.size();
+    }
+
+    void append_layout(PricingKey &key) const {
+        key.add(my_timeline_);
+        for(const auto& def : samples_) key.add(def);
+    }
+
+public:
+    const std::vector<double>& timeline() const override {
+        return my_timeline_;
+    }
+
+    const std::vector<SampleDef<T>>& samples_needed() const override {
+        return samples_;
+    }
+
+    size_t number_of_payoffs() const override {
+        return 1;
+    }
+};
+
+// pays max(average spot - strike, 0) at the last date. state: running sum, payoff
+template <typename T>
+class ArithmeticAsianCall : public MonitoredInstrument<T>{
+    double strike_;
+
+public:
+    ArithmeticAsianCall(double strike, std::vector<double> dates): MonitoredInstrument<T>(std::move(dates)), strike_(strike) {}
+
+    std::unique_ptr<Instrument<T>> clone() const override {
+        return std::make_unique<ArithmeticAsianCall<T>>(*this);
+    }
+
+    size_t state_size() const override { return 2; }
+
+    void start(T *state) const override {
+        state[0] = T(0.0);
+        state[1] = T(0.0);
+    }
+
+    void observe(const size_t date, const MarketSample<T> &sample, T *state) const override {
+        state[0] += sample.forwards[0];
+        if(this->last(date)) state[1] = std::max(state[0] / T(this->my_timeline_.size()) - strike_, T(0.0)) / sample.numeraire;
+    }
+
+    void finish(const T *state, std::vector<T> &payoffs) const override {
+        payoffs[0] = state[1];
+    }
+
+    void append_key(PricingKey &key) const override {
+        key.add("ArithmeticAsianCall");
+        key.add(strike_);
+        this->append_layout(key);
+    }
+};
+
+// pays max(geometric average spot - strike, 0) at the last date. state: running sum of log spots, payoff
+template <typename T>
+class GeometricAsianCall : public MonitoredInstrument<T>{
+    double strike_;
+
+public:
+    GeometricAsianCall(double strike, std::vector<double> dates): MonitoredInstrument<T>(std::move(dates)), strike_(strike) {}
+
+    std::unique_ptr<Instrument<T>> clone() const override {
+        return std::make_unique<GeometricAsianCall<T>>(*this);
+    }
+
+    size_t state_size() const override { return 2; }
+
+    void start(T *state) const override {
+        state[0] = T(0.0);
+        state[1] = T(0.0);
+    }
+
+    void observe(const size_t date, const MarketSample<T> &sample, T *state) const override {
+        state[0] += std::log(sample.forwards[0]);
+        if(this->last(date)) state[1] = std::max(std::exp(state[0] / T(this->my_timeline_.size())) - strike_, T(0.0)) / sample.numeraire;
+    }
+
+    void finish(const T *state, std::vector<T> &payoffs) const override {
+        payoffs[0] = state[1];
+    }
+
+    void append_key(PricingKey &key) const override {
+        key.add("GeometricAsianCall");
+        key.add(strike_);
+        this->append_layout(key);
+    }
+};
+
+// floating strike lookback call, pays the last spot minus the lowest spot seen on the monitoring dates. state:
+// running minimum, payoff
+template <typename T>
+class LookbackCall : public MonitoredInstrument<T>{
+public:
+    explicit LookbackCall(std::vector<double> dates): MonitoredInstrument<T>(std::move(dates)) {}
+
+    std::unique_ptr<Instrument<T>> clone() const override {
+        return std::make_unique<LookbackCall<T>>(*this);
+    }
+
+    size_t state_size() const override { return 2; }
+
+    void start(T *state) const override {
+        state[0] = T(std::numeric_limits<double>::infinity());
+        state[1] = T(0.0);
+    }
+
+    void observe(const size_t date, const MarketSample<T> &sample, T *state) const override {
+        state[0] = std::min(state[0], sample.forwards[0]);
+        if(this->last(date)) state[1] = (sample.forwards[0] - state[0]) / sample.numeraire;
+    }
+
+    void finish(const T *state, std::vector<T> &payoffs) const override {
+        payoffs[0] = state[1];
+    }
+
+    void append_key(PricingKey &key) const override {
+        key.add("LookbackCall");
+        this->append_layout(key);
+    }
+};
+
+// A cliquet: the first date fixes the starting level, every later date resets it and locks in the period return
+// clamped to [local_floor, local_cap]. At the last date it pays notional * max(sum of the clamped returns,
+// global_floor). state: level at the last reset, sum of the clamped returns, payoff
+template <typename T>
+class Cliquet : public MonitoredInstrument<T>{
+    double local_floor_;
+    double local_cap_;
+    double global_floor_;
+    double notional_;
+
+public:
+    Cliquet(std::vector<double> dates, double local_floor, double local_cap, double global_floor, double notional = 1.0)
+        : MonitoredInstrument<T>(std::move(dates), 2), local_floor_(local_floor), local_cap_(local_cap),
+          global_floor_(global_floor), notional_(notional) {}
+
+    std::unique_ptr<Instrument<T>> clone() const override {
+        return std::make_unique<Cliquet<T>>(*this);
+    }
+
+    size_t state_size() const override { return 3; }
+
+    void start(T *state) const override {
+        std::fill(state, state + 3, T(0.0));
+    }
+
+    void observe(const size_t date, const MarketSample<T> &sample, T *state) const override {
+        const T spot = sample.forwards[0];
+        if(date > 0){
+            const T period_return = spot / state[0] - T(1.0);
+            state[1] += std::min(std::max(period_return, T(local_floor_)), T(local_cap_));
+        }
+        state[0] = spot;
+        if(this->last(date)) state[2] = notional_ * std::max(state[1], T(global_floor_)) / sample.numeraire;
+    }
+
+    void finish(const T *state, std::vector<T> &payoffs) const override {
+        payoffs[0] = state[2];
+    }
+
+    void append_key(PricingKey &key) const override {
+        key.add("Cliquet");
+        key.add(local_floor_);
+        key.add(local_cap_);
+        key.add(global_floor_);
+        key.add(notional_);
+        this->append_layout(key);
+    }
+};
@@ -2,6 +2,13 @@
 #include <vector>
 #include <algorithm>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <stdexcept>
 #include "ThreadPool.h"
 
 // This header contains the interfaces necessary to run Monte Carlo simulations
@@ -16,6 +23,52 @@ struct SampleDef {
   bool numeraire = true;
   std::vector<double> forward_maturities;
   std::vector<double> discount_maturities;
+
+  // two instruments with equal sample definitions ask the model for exactly the same simulation
+  bool operator==(const SampleDef &rhs) const = default;
+};
+
+// A PricingKey is a canonical byte encoding of everything that determines the outcome of a simulation: the model
+// parameters, the instrument terms and timeline, the rng type and seed, and the number of paths. Instruments,
+// models and rngs append themselves to it, and two pricings with equal keys produce identical results. Doubles are
+// encoded by their bit pattern so the key is exact.
+class PricingKey {
+  std::string bytes_;
+
+public:
+  void add(const double x) {
+    char raw[sizeof(double)];
+    std::memcpy(raw, &x, sizeof(double));
+    bytes_.append(raw, sizeof(double));
+  }
+
+  void add(const std::uint64_t n) {
+    char raw[sizeof(std::uint64_t)];
+    std::memcpy(raw, &n, sizeof(std::uint64_t));
+    bytes_.append(raw, sizeof(std::uint64_t));
+  }
+
+  // tags are length prefixed so that adjacent fields can never run into each other
+  void add(const std::string_view tag) {
+    add(static_cast<std::uint64_t>(tag.size()));
+    bytes_.append(tag);
+  }
+
+  void add(const std::vector<double> &xs) {
+    add(static_cast<std::uint64_t>(xs.size()));
+    for (const auto x : xs) add(x);
+  }
+
+  template <typename T> 
+  void add(const SampleDef<T> &def) {
+    add(static_cast<std::uint64_t>(def.numeraire));
+    add(def.forward_maturities);
+    add(def.discount_maturities);
+  }
+
+  const std::string &bytes() const { return bytes_; }
+
+  bool operator==(const PricingKey &rhs) const = default;
 };
 
 // A market sample is all of the observations we need on a single day to value
@@ -44,6 +97,10 @@ struct MarketSample {
 // flexibility to price exotic path dependent options
 template <typename T> using Scenario = std::vector<MarketSample<T>>;
 
+// the engines generate paths in blocks of this many so that instruments which can evaluate many paths at once
+// (see Instrument::block_payoffs) get to do so
+constexpr size_t path_block_size = 64;
+
 // Seperate allocation and initialization because allocation requires hidden
 // locks, and for maximum performance we should be locked for the least amount
 // of time possible
@@ -51,7 +108,7 @@ template <typename T>
 inline void allocate_path(const std::vector<SampleDef<T>> &samples_needed,
                           Scenario<T> &path) {
   path.resize(samples_needed.size());
-  for (auto i = 0; i < samples_needed.size(); ++i) {
+  for (size_t i = 0; i < samples_needed.size(); ++i) {
     path[i].allocate(samples_needed[i]);
   }
 }
@@ -72,13 +129,56 @@ class Instrument {
 public:
   virtual const std::vector<double> &timeline() const = 0;
   virtual const std::vector<SampleDef<T>> &samples_needed() const = 0;
-  virtual const size_t number_of_payoffs() const = 0;
+  virtual size_t number_of_payoffs() const = 0;
 
   virtual void payoffs(const Scenario<T> &path,
                        std::vector<T> &payoffs) const = 0;
 
+  // the payoffs of paths[0], ..., paths[count-1] into payoffs[0], ..., payoffs[count-1]. Instruments that can
+  // vectorise across paths override this, the default just prices one path at a time
+  virtual void block_payoffs(const std::vector<Scenario<T>> &paths, const size_t count,
+                             std::vector<T> *payoffs) const {
+    for (size_t i = 0; i < count; ++i) this->payoffs(paths[i], payoffs[i]);
+  }
+
   virtual std::unique_ptr<Instrument<T>> clone() const = 0;
   virtual ~Instrument(){}
+
+  // append the instruments terms, timeline and sample definitions to a pricing key
+  virtual void append_key(PricingKey &key) const = 0;
+};
+
+// Path dependent products that only need running statistics of the path (averages, extremes, accumulated
+// returns) can be priced without ever holding a whole Scenario: the model streams each MarketSample to the
+// instrument as soon as it is generated, and the instrument folds it into a small state vector that the caller
+// owns, so the instrument itself stays const and shareable between threads. The state is state_size() values,
+// start() resets it for a new path, observe() is called once per date in timeline order, and finish() turns the
+// state into the payoffs.
+template <typename T>
+class StreamingInstrument : public Instrument<T> {
+public:
+  virtual size_t state_size() const = 0;
+  virtual void start(T *state) const = 0;
+  virtual void observe(const size_t date, const MarketSample<T> &sample, T *state) const = 0;
+  virtual void finish(const T *state, std::vector<T> &payoffs) const = 0;
+
+  // a streaming instrument is still an ordinary instrument for the other engines, a whole path is simply
+  // replayed one sample at a time
+  void payoffs(const Scenario<T> &path, std::vector<T> &payoffs) const override {
+    thread_local std::vector<T> state;
+    state.resize(state_size());
+    start(state.data());
+    for (size_t i = 0; i < path.size(); ++i) observe(i, path[i], state.data());
+    finish(state.data(), payoffs);
+  }
+};
+
+// what a model streams its samples to, see FinancialModel::stream_path
+template <typename T>
+class SampleObserver {
+public:
+  virtual void observe(const size_t date, const MarketSample<T> &sample) = 0;
+  virtual ~SampleObserver(){}
 };
 
 // ABC interface for financial models. For us this will mostly be the
@@ -90,6 +190,75 @@ public:
 // simulates whatever observations the instrument needs to determine its
 // price.
 
+// The precomputed tables of a model, cached by trade shape and by the values of the parameters they depend on.
+// A model and every clone of it share one cache, and the engines always price on clones, so whatever one pricing
+// built is still there for the next pricing of the same trade, and moving a parameter back and forth (the greeks,
+// calibration bumps) finds the tables it had before. Entries are immutable once built, so clones on different
+// threads can share them.
+template <typename T, typename Tables>
+class ModelTableCache {
+  struct Entry {
+    std::vector<double> timeline;
+    std::vector<SampleDef<T>> samples;
+    std::vector<T> parameters;
+    std::shared_ptr<const Tables> tables;
+  };
+
+  // most recently used first
+  std::list<Entry> entries_;
+  size_t capacity_;
+  size_t hits_{0};
+  size_t misses_{0};
+  size_t recomputes_{0};
+  mutable std::mutex mutex_;
+
+public:
+  explicit ModelTableCache(const size_t capacity = 16) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+  // The tables for this shape and these parameters. On a miss they come from build(nearest, nearest_parameters,
+  // recomputes), where nearest are the most recently used tables of the same shape (nullptr if there are none)
+  // so that build only has to redo what depends on a parameter that moved, counting each table it redoes.
+  template <typename Build>
+  std::shared_ptr<const Tables> find_or_build(const std::vector<double> &timeline,
+                                              const std::vector<SampleDef<T>> &samples,
+                                              const std::vector<T> &parameters, Build &&build) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto nearest = entries_.end();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->timeline != timeline || it->samples != samples) continue;
+      if (it->parameters == parameters) {
+        entries_.splice(entries_.begin(), entries_, it);
+        ++hits_;
+        return it->tables;
+      }
+      if (nearest == entries_.end()) nearest = it;
+    }
+
+    ++misses_;
+    std::shared_ptr<const Tables> tables =
+        nearest == entries_.end()
+            ? std::make_shared<const Tables>(build(nullptr, nullptr, recomputes_))
+            : std::make_shared<const Tables>(build(nearest->tables.get(), &nearest->parameters, recomputes_));
+    entries_.push_front(Entry{timeline, samples, parameters, tables});
+    if (entries_.size() > capacity_) entries_.pop_back();
+    return tables;
+  }
+
+  size_t hits() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return hits_;
+  }
+  size_t misses() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return misses_;
+  }
+  // the number of individual tables rebuilt over all misses
+  size_t recomputes() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return recomputes_;
+  }
+};
+
 // Finally the parameter functions give clients access to the model parameters
 // i.e. in Black-Scholes model this is spot/vol/div client code needs to modify
 // these parameters in order to calculate the greeks
@@ -106,11 +275,21 @@ public:
   virtual void generate_path(const std::vector<double> &gaussian_vector,
                              Scenario<T> &path) const = 0;
 
+  // the streaming counterpart of generate_path: each date is generated into the same sample, which is handed to
+  // the observer before the next date overwrites it
+  virtual void stream_path(const std::vector<double> & /*gaussian_vector*/, MarketSample<T> & /*sample*/,
+                           SampleObserver<T> & /*observer*/) const {
+    throw std::runtime_error("this model does not support streaming paths");
+  }
+
   virtual std::unique_ptr<FinancialModel<T>> clone() const = 0;
   virtual ~FinancialModel(){}
 
   virtual const std::vector<T *> &parameters() = 0;
 
+  // append the model type and its current parameter values to a pricing key
+  virtual void append_key(PricingKey &key) const = 0;
+
   size_t number_of_parameters() const {
     return const_cast<FinancialModel<T> *>(this)->parameters().size();
   }
@@ -130,12 +309,19 @@ public:
   // this has the added benefit that a parallel simulation and non parallel simulation with the same seed will have the same result.
   // In order to avoid directly implementing this for the Mersenne Twist RNG (which is possible but tedious), 
   // the function has a default implementation that just runs the RNG and throws away the results.
-  virtual void jump_ahead(const unsigned steps) = 0;
+  // steps counts whole gaussian vectors (paths), a size_t since sharded runs index paths beyond 2^32. Every
+  // implementation has to be exact: the next get_gaussians after jump_ahead(n) returns exactly what the n + 1st
+  // call would have. The parallel engines, the scheduler, sharding and the pricing cache all rely on that.
+  virtual void jump_ahead(const size_t steps) = 0;
 
   virtual std::unique_ptr<RNG> clone() const = 0;
   virtual ~RNG(){}
 
   virtual size_t simulation_dimension() const = 0;
+
+  // append the rng type and seed to a pricing key. The engines always start from the rng they are handed, so
+  // this assumes that rng has not been advanced, which is how the engines are meant to be called anyway
+  virtual void append_key(PricingKey &key) const = 0;
 };
 
 // Finally we have the monte carlo algorithm, which is fully generic on the
@@ -145,9 +331,10 @@ monte_carlo_simulation(const Instrument<double> &instrument,
                        const FinancialModel<double> &model, 
                        const RNG &rng,
                        const size_t num_paths) {
-  // right now the model and rng are easy to copy because they haven't been initialized yet,
-  // working with copies of them is convenient because we can use the same model and rng 
-  // to price many different products in sequence.
+  // we work on copies of the model and rng so the same ones can price many different products in sequence.
+  // Cloning is cheap either way: the models share their precomputed tables with their clones through a
+  // ModelTableCache, so if this trade (or one of its shape) was priced before, allocate/initialize below find the
+  // tables already built and only redo what depends on a parameter that moved.
   auto c_model = model.clone();
   auto c_rng = rng.clone();
 
@@ -161,19 +348,65 @@ monte_carlo_simulation(const Instrument<double> &instrument,
   c_rng->initialize(c_model->simulation_dimension());
   std::vector<double> gaussian_vector(c_model->simulation_dimension());
 
-  Scenario<double> path;
-  allocate_path(instrument.samples_needed(), path);
-  initialize_path(path);
+  std::vector<Scenario<double>> paths(std::min(num_paths, path_block_size));
+  for (auto &path : paths) {
+    allocate_path(instrument.samples_needed(), path);
+    initialize_path(path);
+  }
 
-  for (auto i = 0; i < num_paths; ++i) {
-    c_rng->get_gaussians(gaussian_vector);
-    c_model->generate_path(gaussian_vector, path);
-    instrument.payoffs(path, results[i]);
+  for (size_t first = 0; first < num_paths; first += path_block_size) {
+    const size_t count = std::min(path_block_size, num_paths - first);
+    for (size_t i = 0; i < count; ++i) {
+      c_rng->get_gaussians(gaussian_vector);
+      c_model->generate_path(gaussian_vector, paths[i]);
+    }
+    instrument.block_payoffs(paths, count, &results[first]);
   }
   return results;
 }
 
 
+// monte_carlo_simulation for streaming instruments. No path is ever held in memory: the model streams every
+// sample into the instruments running state, so the memory used per path is the gaussians and that state
+// however many dates the product monitors.
+inline std::vector<std::vector<double>>
+streaming_monte_carlo_simulation(const StreamingInstrument<double> &instrument,
+                                 const FinancialModel<double> &model,
+                                 const RNG &rng,
+                                 const size_t num_paths) {
+  auto c_model = model.clone();
+  auto c_rng = rng.clone();
+
+  std::vector<std::vector<double>> results(num_paths, std::vector<double>(instrument.number_of_payoffs()));
+
+  c_model->allocate(instrument.timeline(), instrument.samples_needed());
+  c_model->initialize(instrument.timeline(), instrument.samples_needed());
+
+  c_rng->initialize(c_model->simulation_dimension());
+  std::vector<double> gaussian_vector(c_model->simulation_dimension());
+
+  struct Feed final : SampleObserver<double> {
+    const StreamingInstrument<double> *instrument;
+    double *state;
+    void observe(const size_t date, const MarketSample<double> &sample) override {
+      instrument->observe(date, sample, state);
+    }
+  };
+  std::vector<double> state(instrument.state_size());
+  Feed feed;
+  feed.instrument = &instrument;
+  feed.state = state.data();
+
+  MarketSample<double> sample;
+  for (size_t i = 0; i < num_paths; ++i) {
+    c_rng->get_gaussians(gaussian_vector);
+    instrument.start(state.data());
+    c_model->stream_path(gaussian_vector, sample, feed);
+    instrument.finish(state.data(), results[i]);
+  }
+  return results;
+}
+
 inline std::vector<std::vector<double>> 
 parallel_monte_carlo_simulation(
   const Instrument<double>& instrument,
@@ -184,10 +417,10 @@ parallel_monte_carlo_simulation(
 // The parallel version of our simulation. finally all of our hardwork will (hopefully) shine!
 {
   // this is the number of iterations we will assign to each thread per chunk
-  size_t batch_size = 1;
+  const size_t batch_size = 256;
 
-  // The model and rng are currently uninitialized and can be copied easily. Our simulation works with its own copies 
-  // of the rng and model so that we can price many different instruments sequentially using the same model and rng.
+  // Our simulation works with its own copies of the rng and model so that we can price many different instruments
+  // sequentially using the same model and rng. The clone shares the models table cache, see monte_carlo_simulation.
   auto cmodel = model.clone();
   auto crng = rng.clone();
 
@@ -208,66 +441,64 @@ parallel_monte_carlo_simulation(
   pool -> start();
   const size_t thread_count = pool->number_of_threads();
 
-  // allocate a gaussian vector and a path for each thread to use
-  std::vector<std::vector<double>> gaussian_matrix(thread_count + 1);
-  std::vector<Scenario<double>> path_matrix(thread_count + 1);
-  for(auto& vec : gaussian_matrix) vec.resize(cmodel->simulation_dimension());
-  
-  // initialize each threads path vector
-  for(auto& path : path_matrix){
-    allocate_path(instrument.samples_needed(), path);
-    initialize_path(path);
-  }
-
-  // each thread will have its own copy of the rng
-  std::vector<std::unique_ptr<RNG>> rng_vector(thread_count + 1);
-  for(auto& gen : rng_vector){
-    gen = rng.clone();
-    gen->initialize(cmodel->simulation_dimension());
-  }
-
+  // each thread gets its own gaussian vector, path and copy of the rng. These are allocated lazily by the thread
+  // that owns them, on its first chunk, rather than up front by the main thread: with first-touch page placement
+  // that keeps each workers scratch on its own NUMA node when the pool is pinned. The scratch lives for this call
+  // only, the next call allocates (and first touches) it again, it is not kept per worker across calls.
+  struct ThreadScratch {
+    std::vector<double> gaussian_vector;
+    std::vector<Scenario<double>> paths;
+    std::unique_ptr<RNG> generator;
+
+    // each generator is positioned absolutely: we remember how many paths into the stream this threads rng is, 
+    // and jump it forward by the difference. Chunks are handed out in order, so a thread only ever sees increasing
+    // first_paths. Because jump_ahead has to be exact (see RNG::jump_ahead, both our rngs are) every path gets the
+    // gaussians the sequential engine would have given it, and the result does not depend on which thread ran
+    // which chunk. An rng with an approximate jump would break that, and silently reuse gaussians across chunks.
+    size_t rng_position{0};
+  };
+  std::vector<std::unique_ptr<ThreadScratch>> scratch(thread_count + 1);
 
   // now the book-keeping starts and its easy to get confused
-
-  // this is the number of tasks that need to be assigned. 
-  std::vector<std::future<bool>> future_vector(number_of_iterations / batch_size + 1);
-
-  // in each iteration the producer will increment the first_path in the batch, starting with 0
-  size_t first_path = 0;
-  // and decrement the number of paths_left -- starting with the full count
-  size_t paths_left = number_of_iterations;
-  while(paths_left > 0){
-    // all but the last batch will receive batch_size paths to compute
-    size_t paths_in_task = std::min(paths_left, batch_size);
-
-    // the producer bundles up a nice bit of work and kicks it to the threadpool in 
-    // a lambda, the spawn_task function returns a future<bool> for that work,
-    // which is pushed into our futures_vector
-    future_vector.push_back(pool->spawn_task([&, first_path, paths_in_task](){
-      // the thread_number lets helps us pick the correct gaussian_vector and path to use in our calculation
-      const size_t thread_num = pool -> thread_number();
-      std::vector<double>& gaussian_vector = gaussian_matrix[thread_num];
-      Scenario<double>& path = path_matrix[thread_num];
-      
-      // keeping track of the first_path lets us jump the rng to the correct spot
-      auto& generator = rng_vector[thread_num];
-      generator -> jump_ahead(first_path);
-
-      for(size_t i = 0; i < paths_in_task; ++i){
-        generator->get_gaussians(gaussian_vector);
-        cmodel ->generate_path(gaussian_vector, path);
-        instrument.payoffs(path, results[first_path + i]);
+  const size_t number_of_tasks = (number_of_iterations + batch_size - 1) / batch_size;
+
+  // the task for chunk k computes paths [k * batch_size, min((k+1) * batch_size, number_of_iterations))
+  auto task = [&](const size_t k){
+    const size_t first_path = k * batch_size;
+    const size_t paths_in_task = std::min(number_of_iterations - first_path, batch_size);
+
+    // the thread_number lets helps us pick the correct scratch to use in our calculation
+    auto& mine = scratch[pool -> thread_number()];
+    if(!mine){
+      mine = std::make_unique<ThreadScratch>();
+      mine->gaussian_vector.resize(cmodel->simulation_dimension());
+      mine->paths.resize(path_block_size);
+      for(auto& path : mine->paths){
+        allocate_path(instrument.samples_needed(), path);
+        initialize_path(path);
       }
-      // return for lambda expression, not entire function. 
-      return true;
-    }));
-
-    paths_left -= paths_in_task;
-    first_path += paths_in_task;
-  }
-  
-  //for(auto& future : future_vector) {
-  //  pool -> active_wait(future);
-  //}
+      mine->generator = rng.clone();
+      mine->generator->initialize(cmodel->simulation_dimension());
+    }
+    
+    // keeping track of the first_path lets us jump the rng to the correct spot
+    mine->generator->jump_ahead(first_path - mine->rng_position);
+
+    for(size_t first = first_path; first < first_path + paths_in_task; first += path_block_size){
+      const size_t count = std::min(path_block_size, first_path + paths_in_task - first);
+      for(size_t i = 0; i < count; ++i){
+        mine->generator->get_gaussians(mine->gaussian_vector);
+        cmodel->generate_path(mine->gaussian_vector, mine->paths[i]);
+      }
+      instrument.block_payoffs(mine->paths, count, &results[first]);
+    }
+    mine->rng_position = first_path + paths_in_task;
+  };
+
+  // the whole range is enqueued in one go, and the latch tells us when every chunk is done. The tasks reference 
+  // our locals, so every one of them has to finish before we return
+  TaskLatch done;
+  pool -> spawn_bulk(number_of_tasks, task, done);
+  pool -> wait(done);
   return results;
 }
\ No newline at end of file
@@ -0,0 +1,336 @@
+#pragma once
+#include "MCLib.h"
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// For XVA style workflows we simulate a set of Scenario<double> paths once, write them to disk, and later reprice
+// many different instruments against the same paths. The on disk format is
+//
+//   header    magic "MCLPATHS", format version, number of paths, doubles per path, offset of the data block
+//   layout    the timeline, then every SampleDef (numeraire flag, forward maturities, discount maturities)
+//   padding   up to a 64 byte boundary
+//   data      path contiguous doubles. each path stores, for each date on the timeline, its numeraire
+//             followed by its forwards and its discounts
+//
+// Everything is written in the native byte order, the files are meant to be replayed on the machine (or
+// at least the architecture) that produced them.
+
+constexpr char path_store_magic[8] = {'M', 'C', 'L', 'P', 'A', 'T', 'H', 'S'};
+constexpr std::uint32_t path_store_version = 1;
+constexpr size_t path_store_alignment = 64;
+
+namespace path_store_detail {
+
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+  std::uint64_t number_of_paths;
+  std::uint64_t doubles_per_path;
+  std::uint64_t data_offset;
+};
+
+inline size_t doubles_per_path(const std::vector<SampleDef<double>> &samples) {
+  size_t n = 0;
+  for (const auto &def : samples) n += 1 + def.forward_maturities.size() + def.discount_maturities.size();
+  return n;
+}
+
+// the layout section is a flat sequence of u64 counts and doubles, both 8 bytes wide
+inline std::vector<double> encode_layout(const std::vector<double> &timeline,
+                                         const std::vector<SampleDef<double>> &samples) {
+  auto count = [](const size_t n) {
+    double d;
+    const std::uint64_t u = n;
+    std::memcpy(&d, &u, sizeof(double));
+    return d;
+  };
+
+  std::vector<double> layout;
+  layout.push_back(count(timeline.size()));
+  layout.insert(layout.end(), timeline.begin(), timeline.end());
+  for (const auto &def : samples) {
+    layout.push_back(count(def.numeraire));
+    layout.push_back(count(def.forward_maturities.size()));
+    layout.insert(layout.end(), def.forward_maturities.begin(), def.forward_maturities.end());
+    layout.push_back(count(def.discount_maturities.size()));
+    layout.insert(layout.end(), def.discount_maturities.begin(), def.discount_maturities.end());
+  }
+  return layout;
+}
+
+inline size_t aligned(const size_t offset) {
+  return (offset + path_store_alignment - 1) / path_store_alignment * path_store_alignment;
+}
+
+// copies one simulated path into its slot of the data block
+inline void flatten_path(const Scenario<double> &path, double *out) {
+  for (const auto &sample : path) {
+    *out++ = sample.numeraire;
+    out = std::copy(sample.forwards.begin(), sample.forwards.end(), out);
+    out = std::copy(sample.discounts.begin(), sample.discounts.end(), out);
+  }
+}
+
+} // namespace path_store_detail
+
+// Simulates num_paths paths of model over the given timeline and sample definitions and streams them to
+// filename, chunk_size paths at a time, so the whole set never has to fit in memory. The timeline and samples
+// should be the union of whatever the instruments that will later be replayed against the file need.
+inline void simulate_to_path_store(const std::string &filename,
+                                   const std::vector<double> &timeline,
+                                   const std::vector<SampleDef<double>> &samples,
+                                   const FinancialModel<double> &model,
+                                   const RNG &rng,
+                                   const size_t num_paths,
+                                   const size_t chunk_size = 4096) {
+  using namespace path_store_detail;
+
+  // the layout pairs every date with its sample definition, a store written with one missing or extra would
+  // later be read out of bounds by the replay
+  if (samples.size() != timeline.size())
+    throw std::invalid_argument("simulate_to_path_store: " + std::to_string(samples.size()) +
+                                " sample definitions for " + std::to_string(timeline.size()) + " dates");
+
+  auto c_model = model.clone();
+  auto c_rng = rng.clone();
+  c_model->allocate(timeline, samples);
+  c_model->initialize(timeline, samples);
+  c_rng->initialize(c_model->simulation_dimension());
+
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  if (!out) throw std::runtime_error("simulate_to_path_store: cannot open " + filename);
+
+  const auto layout = encode_layout(timeline, samples);
+  const size_t layout_end = sizeof(Header) + layout.size() * sizeof(double);
+
+  Header header{};
+  std::memcpy(header.magic, path_store_magic, sizeof(header.magic));
+  header.version = path_store_version;
+  header.number_of_paths = num_paths;
+  header.doubles_per_path = doubles_per_path(samples);
+  header.data_offset = aligned(layout_end);
+
+  out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+  out.write(reinterpret_cast<const char *>(layout.data()), layout.size() * sizeof(double));
+  const std::vector<char> padding(header.data_offset - layout_end, 0);
+  out.write(padding.data(), padding.size());
+
+  std::vector<double> gaussian_vector(c_model->simulation_dimension());
+  Scenario<double> path;
+  allocate_path(samples, path);
+  initialize_path(path);
+
+  const size_t chunk = std::max<size_t>(chunk_size, 1);
+  std::vector<double> buffer(std::min(chunk, num_paths) * header.doubles_per_path);
+  for (size_t first_path = 0; first_path < num_paths; first_path += chunk) {
+    const size_t paths_in_chunk = std::min(chunk, num_paths - first_path);
+    for (size_t i = 0; i < paths_in_chunk; ++i) {
+      c_rng->get_gaussians(gaussian_vector);
+      c_model->generate_path(gaussian_vector, path);
+      flatten_path(path, buffer.data() + i * header.doubles_per_path);
+    }
+    out.write(reinterpret_cast<const char *>(buffer.data()),
+              paths_in_chunk * header.doubles_per_path * sizeof(double));
+  }
+
+  if (!out) throw std::runtime_error("simulate_to_path_store: failed writing " + filename);
+}
+
+// A read only memory mapping of a path store file. The header and layout are parsed once on open, after that
+// paths are read straight out of the mapping.
+class PathStore {
+  int fd_{-1};
+  void *mapping_{nullptr};
+  size_t mapping_size_{0};
+
+  std::vector<double> timeline_;
+  std::vector<SampleDef<double>> samples_;
+  size_t number_of_paths_{0};
+  size_t doubles_per_path_{0};
+  const double *data_{nullptr};
+
+  void close() {
+    if (mapping_) munmap(mapping_, mapping_size_);
+    if (fd_ >= 0) ::close(fd_);
+    mapping_ = nullptr;
+    fd_ = -1;
+  }
+
+  void parse(const std::string &filename) {
+    using namespace path_store_detail;
+    auto fail = [&](const char *what) {
+      throw std::runtime_error("PathStore: " + filename + ": " + what);
+    };
+
+    if (mapping_size_ < sizeof(Header)) fail("file too small");
+    Header header;
+    std::memcpy(&header, mapping_, sizeof(Header));
+    if (std::memcmp(header.magic, path_store_magic, sizeof(header.magic)) != 0) fail("not a path store");
+    if (header.version != path_store_version) fail("unsupported version");
+    if (header.data_offset % path_store_alignment != 0 || header.data_offset < sizeof(Header) ||
+        header.data_offset > mapping_size_)
+      fail("bad data offset");
+    // the data block has to fit in what follows the offset, checked by dividing that room so that no product of
+    // header fields can overflow
+    const std::uint64_t data_room = (mapping_size_ - header.data_offset) / sizeof(double);
+    if (header.doubles_per_path != 0 && header.number_of_paths > data_room / header.doubles_per_path)
+      fail("truncated data block");
+
+    // walk the layout section, every field is 8 bytes
+    const char *cursor = static_cast<const char *>(mapping_) + sizeof(Header);
+    const char *layout_end = static_cast<const char *>(mapping_) + header.data_offset;
+    auto next_count = [&]() {
+      if (static_cast<size_t>(layout_end - cursor) < sizeof(std::uint64_t)) fail("truncated layout");
+      std::uint64_t u;
+      std::memcpy(&u, cursor, sizeof(u));
+      cursor += sizeof(u);
+      return static_cast<size_t>(u);
+    };
+    auto next_doubles = [&](std::vector<double> &xs) {
+      const size_t count = next_count();
+      if (count > static_cast<size_t>(layout_end - cursor) / sizeof(double)) fail("truncated layout");
+      xs.resize(count);
+      std::memcpy(xs.data(), cursor, xs.size() * sizeof(double));
+      cursor += xs.size() * sizeof(double);
+    };
+
+    next_doubles(timeline_);
+    samples_.resize(timeline_.size());
+    for (auto &def : samples_) {
+      def.numeraire = next_count() != 0;
+      next_doubles(def.forward_maturities);
+      next_doubles(def.discount_maturities);
+    }
+
+    if (path_store_detail::doubles_per_path(samples_) != header.doubles_per_path) fail("layout does not match data block");
+    number_of_paths_ = header.number_of_paths;
+    doubles_per_path_ = header.doubles_per_path;
+    data_ = reinterpret_cast<const double *>(static_cast<const char *>(mapping_) + header.data_offset);
+  }
+
+public:
+  explicit PathStore(const std::string &filename) {
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) throw std::runtime_error("PathStore: cannot open " + filename);
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      close();
+      throw std::runtime_error("PathStore: cannot stat " + filename);
+    }
+    mapping_size_ = static_cast<size_t>(st.st_size);
+
+    void *mapping = mapping_size_ ? mmap(nullptr, mapping_size_, PROT_READ, MAP_SHARED, fd_, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED) {
+      close();
+      throw std::runtime_error("PathStore: cannot map " + filename);
+    }
+    mapping_ = mapping;
+    // replay walks the paths front to back
+    madvise(mapping_, mapping_size_, MADV_SEQUENTIAL);
+
+    try {
+      parse(filename);
+    } catch (...) {
+      close();
+      throw;
+    }
+  }
+
+  PathStore(const PathStore &rhs) = delete;
+  PathStore &operator=(const PathStore &rhs) = delete;
+
+  ~PathStore() { close(); }
+
+  const std::vector<double> &timeline() const { return timeline_; }
+  const std::vector<SampleDef<double>> &samples_needed() const { return samples_; }
+  size_t number_of_paths() const { return number_of_paths_; }
+  size_t doubles_per_path() const { return doubles_per_path_; }
+
+  // the i'th path, laid out as described at the top of this file
+  const double *path(const size_t i) const { return data_ + i * doubles_per_path_; }
+};
+
+// For every value of the instruments Scenario, where it lives inside a stored path. Instruments do not have to
+// need everything in the store, only a subset of its dates and maturities.
+inline std::vector<size_t> path_store_gather_map(const PathStore &store, const Instrument<double> &instrument) {
+  auto same = [](const double a, const double b) { return std::abs(a - b) <= 1e-12; };
+  auto index_of = [&](const std::vector<double> &xs, const double x, const char *what) {
+    auto it = std::find_if(xs.begin(), xs.end(), [&](const double y) { return same(x, y); });
+    if (it == xs.end()) throw std::runtime_error(std::string("path store has no ") + what + " the instrument needs");
+    return static_cast<size_t>(it - xs.begin());
+  };
+
+  // where each stored date starts inside a path
+  std::vector<size_t> date_offsets;
+  size_t offset = 0;
+  for (const auto &def : store.samples_needed()) {
+    date_offsets.push_back(offset);
+    offset += 1 + def.forward_maturities.size() + def.discount_maturities.size();
+  }
+
+  std::vector<size_t> gather;
+  const auto &timeline = instrument.timeline();
+  const auto &samples = instrument.samples_needed();
+  for (size_t i = 0; i < timeline.size(); ++i) {
+    const size_t k = index_of(store.timeline(), timeline[i], "date");
+    const auto &stored = store.samples_needed()[k];
+    if (samples[i].numeraire && !stored.numeraire) throw std::runtime_error("path store has no numeraire the instrument needs");
+
+    gather.push_back(date_offsets[k]);
+    for (const auto t : samples[i].forward_maturities)
+      gather.push_back(date_offsets[k] + 1 + index_of(stored.forward_maturities, t, "forward"));
+    for (const auto t : samples[i].discount_maturities)
+      gather.push_back(date_offsets[k] + 1 + stored.forward_maturities.size() +
+                       index_of(stored.discount_maturities, t, "discount"));
+  }
+  return gather;
+}
+
+// The replay engine. Prices instrument against every path in the store, in parallel over ranges of paths. The
+// Instrument interface takes a Scenario, so each path is copied out of the mapping into the chunk's one Scenario,
+// only the values the instrument needs, picked by the gather map. Nothing is allocated per path.
+inline std::vector<std::vector<double>>
+replay_path_store(const PathStore &store, const Instrument<double> &instrument, const size_t chunk_size = 1024) {
+  const auto gather = path_store_gather_map(store, instrument);
+  const auto &samples = instrument.samples_needed();
+  const size_t number_of_paths = store.number_of_paths();
+
+  std::vector<std::vector<double>> results(number_of_paths, std::vector<double>(instrument.number_of_payoffs()));
+
+  ThreadPool *pool = ThreadPool::get_instance();
+  pool->start();
+
+  const size_t chunk = std::max<size_t>(chunk_size, 1);
+  const size_t number_of_tasks = (number_of_paths + chunk - 1) / chunk;
+  auto task = [&](const size_t k) {
+    const size_t first_path = k * chunk;
+    const size_t paths_in_task = std::min(chunk, number_of_paths - first_path);
+
+    Scenario<double> path;
+    allocate_path(samples, path);
+    initialize_path(path);
+
+    for (size_t i = first_path; i < first_path + paths_in_task; ++i) {
+      const double *stored = store.path(i);
+      auto slot = gather.begin();
+      for (auto &sample : path) {
+        sample.numeraire = stored[*slot++];
+        for (auto &f : sample.forwards) f = stored[*slot++];
+        for (auto &d : sample.discounts) d = stored[*slot++];
+      }
+      instrument.payoffs(path, results[i]);
+    }
+  };
+
+  TaskLatch done;
+  pool->spawn_bulk(number_of_tasks, task, done);
+  pool->wait(done);
+  return results;
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include "MCLib.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// Risk batches reprice the same (model, instrument, rng seed, path count) tuples over and over across reports.
+// Our rng streams are deterministic, and the parallel engine positions them with jump_ahead, which every rng has
+// to implement exactly (see RNG::jump_ahead). So the result of a pricing is a pure function of its PricingKey
+// with either engine, and the PricingCache can sit in front of them and hand back the earlier result exactly.
+// An rng whose jump was only approximate would make parallel results depend on scheduling, the cache would then
+// freeze one arbitrary run, which is why the contract is on the rng and tested for each of them.
+
+struct PricingCacheStats {
+  size_t hits{0};
+  size_t misses{0};
+  size_t evictions{0};
+  size_t entries{0};
+  size_t bytes{0};
+};
+
+// which engine produced a result is part of the key, the sequential and parallel engines consume the rng
+// stream differently
+enum class PricingEngine { sequential, parallel };
+
+inline PricingKey make_pricing_key(const Instrument<double> &instrument,
+                                   const FinancialModel<double> &model,
+                                   const RNG &rng,
+                                   const size_t num_paths,
+                                   const PricingEngine engine = PricingEngine::sequential) {
+  PricingKey key;
+  instrument.append_key(key);
+  model.append_key(key);
+  rng.append_key(key);
+  key.add(static_cast<std::uint64_t>(num_paths));
+  key.add(static_cast<std::uint64_t>(engine));
+  return key;
+}
+
+// A thread safe LRU cache of simulation results, bounded by the (approximate) number of bytes the cached
+// results occupy. Results are shared rather than copied out, a million path result is not something we want
+// to duplicate on every hit.
+class PricingCache {
+public:
+  using Result = std::vector<std::vector<double>>;
+
+private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const Result> result;
+    size_t bytes;
+  };
+
+  // most recently used at the front. list nodes never move, so the index can view the keys they own
+  std::list<Entry> lru_;
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+
+  const size_t max_bytes_;
+  size_t bytes_{0};
+  size_t hits_{0};
+  size_t misses_{0};
+  size_t evictions_{0};
+  mutable std::mutex mutex_;
+
+  static size_t footprint(const std::string &key, const Result &result) {
+    size_t bytes = key.size() + sizeof(Entry) + result.size() * sizeof(std::vector<double>);
+    for (const auto &payoffs : result) bytes += payoffs.size() * sizeof(double);
+    return bytes;
+  }
+
+  // must be called with the lock held
+  void evict_until_fits(const size_t incoming) {
+    while (!lru_.empty() && bytes_ + incoming > max_bytes_) {
+      const Entry &victim = lru_.back();
+      bytes_ -= victim.bytes;
+      index_.erase(victim.key);
+      lru_.pop_back();
+      ++evictions_;
+    }
+  }
+
+public:
+  explicit PricingCache(const size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  PricingCache(const PricingCache &rhs) = delete;
+  PricingCache &operator=(const PricingCache &rhs) = delete;
+
+  // returns the cached result for key, or nullptr on a miss. A hit makes the entry the most recently used.
+  std::shared_ptr<const Result> find(const PricingKey &key) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto it = index_.find(key.bytes());
+    if (it == index_.end()) {
+      ++misses_;
+      return nullptr;
+    }
+    ++hits_;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->result;
+  }
+
+  // results larger than the whole budget are not kept. If two threads raced to compute the same key the first
+  // insert wins, both computed the same numbers anyway.
+  std::shared_ptr<const Result> insert(const PricingKey &key, Result result) {
+    auto shared = std::make_shared<const Result>(std::move(result));
+    const size_t bytes = footprint(key.bytes(), *shared);
+
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (auto it = index_.find(key.bytes()); it != index_.end()) return it->second->result;
+    if (bytes > max_bytes_) return shared;
+
+    evict_until_fits(bytes);
+    lru_.push_front(Entry{key.bytes(), shared, bytes});
+    index_.emplace(lru_.front().key, lru_.begin());
+    bytes_ += bytes;
+    return shared;
+  }
+
+  // the simulation itself runs outside the lock so that misses on different keys price concurrently, with either
+  // engine, parallel pricings from several callers just share the pool's workers
+  std::shared_ptr<const Result> price(const Instrument<double> &instrument,
+                                      const FinancialModel<double> &model,
+                                      const RNG &rng,
+                                      const size_t num_paths,
+                                      const PricingEngine engine = PricingEngine::sequential) {
+    const auto key = make_pricing_key(instrument, model, rng, num_paths, engine);
+    if (auto hit = find(key)) return hit;
+
+    Result result = engine == PricingEngine::parallel
+                        ? parallel_monte_carlo_simulation(instrument, model, rng, num_paths)
+                        : monte_carlo_simulation(instrument, model, rng, num_paths);
+    return insert(key, std::move(result));
+  }
+
+  PricingCacheStats stats() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return PricingCacheStats{hits_, misses_, evictions_, lru_.size(), bytes_};
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    index_.clear();
+    lru_.clear();
+    bytes_ = 0;
+  }
+};
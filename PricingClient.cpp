@@ -0,0 +1,35 @@
+#include "PricingClient.h"
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+PricingClient::PricingClient(const std::string &socket_path){
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(address.sun_path)) throw std::runtime_error("PricingClient: socket path too long");
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd_ < 0) throw std::runtime_error("PricingClient: cannot create socket");
+    if(::connect(fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0){
+        ::close(fd_);
+        throw std::runtime_error("PricingClient: cannot connect to " + socket_path);
+    }
+}
+
+PricingClient::~PricingClient(){
+    if(fd_ >= 0) ::close(fd_);
+}
+
+PricingResponse PricingClient::price(PricingRequest request){
+    request.request_id = next_request_id_++;
+    if(!write_frame(fd_, &request, sizeof(request))) throw std::runtime_error("PricingClient: server went away");
+
+    PricingResponse response;
+    if(!read_frame(fd_, &response, sizeof(response))) throw std::runtime_error("PricingClient: server went away");
+    if(response.magic != pricing_response_magic || response.request_id != request.request_id)
+        throw std::runtime_error("PricingClient: malformed response");
+    return response;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "PricingProtocol.h"
+#include <string>
+
+// A blocking client for a local pricing_server. One client holds one connection, requests on it are answered in
+// order, so a client should not be shared between threads without external locking.
+class PricingClient {
+  int fd_{-1};
+  std::uint64_t next_request_id_{1};
+
+public:
+  explicit PricingClient(const std::string &socket_path);
+  ~PricingClient();
+
+  PricingClient(const PricingClient &rhs) = delete;
+  PricingClient &operator=(const PricingClient &rhs) = delete;
+
+  // fills in the request id, sends the request and waits for its response. Throws std::runtime_error if the
+  // connection fails, a bad_request or error status is returned to the caller in the response.
+  PricingResponse price(PricingRequest request);
+};
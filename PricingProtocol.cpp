@@ -0,0 +1,30 @@
+#include "PricingProtocol.h"
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+bool read_frame(const int fd, void *data, const std::size_t n){
+    auto *cursor = static_cast<char *>(data);
+    std::size_t left = n;
+    while(left > 0){
+        const ssize_t got = ::recv(fd, cursor, left, 0);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        cursor += got;
+        left -= static_cast<std::size_t>(got);
+    }
+    return true;
+}
+
+bool write_frame(const int fd, const void *data, const std::size_t n){
+    const auto *cursor = static_cast<const char *>(data);
+    std::size_t left = n;
+    while(left > 0){
+        const ssize_t sent = ::send(fd, cursor, left, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        cursor += sent;
+        left -= static_cast<std::size_t>(sent);
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <type_traits>
+
+// The wire format spoken by pricing_server and PricingClient over a local Unix domain socket. Every message is a
+// single fixed size frame sent as raw bytes in the native byte order, client and server always share a machine.
+// A connection carries any number of request/response pairs, answered in order.
+
+constexpr std::uint32_t pricing_request_magic = 0x514c434d;  // "MCLQ"
+constexpr std::uint32_t pricing_response_magic = 0x524c434d; // "MCLR"
+constexpr std::uint16_t pricing_protocol_version = 1;
+
+enum class PricingModelKind : std::uint8_t { black_scholes = 0 };
+enum class PricingInstrumentKind : std::uint8_t { european_call = 0 };
+enum class PricingRngKind : std::uint8_t { mersenne_twist = 0, pcg = 1 };
+
+enum class PricingStatus : std::uint16_t { ok = 0, bad_request = 1, error = 2 };
+
+struct PricingRequest {
+  std::uint32_t magic{pricing_request_magic};
+  std::uint16_t version{pricing_protocol_version};
+  PricingModelKind model{PricingModelKind::black_scholes};
+  PricingInstrumentKind instrument{PricingInstrumentKind::european_call};
+  PricingRngKind rng{PricingRngKind::mersenne_twist};
+  std::uint8_t reserved[7]{};
+  std::uint64_t request_id{0};
+  std::uint64_t seed{42};
+  std::uint64_t num_paths{0};
+
+  // black scholes parameters
+  double spot{0.0};
+  double vol{0.0};
+  double rate{0.0};
+  double div{0.0};
+
+  // european call terms
+  double strike{0.0};
+  double expiration{0.0};
+};
+
+struct PricingResponse {
+  std::uint32_t magic{pricing_response_magic};
+  std::uint16_t version{pricing_protocol_version};
+  PricingStatus status{PricingStatus::ok};
+  std::uint64_t request_id{0};
+  std::uint64_t paths_done{0};
+  double price{0.0};
+  double standard_error{0.0};
+  // time the server spent on the request, from the last byte read to the first byte written
+  double server_microseconds{0.0};
+};
+
+static_assert(std::is_trivially_copyable_v<PricingRequest> && sizeof(PricingRequest) == 88);
+static_assert(std::is_trivially_copyable_v<PricingResponse> && sizeof(PricingResponse) == 48);
+
+// reads or writes exactly n bytes on a blocking socket, false if the peer went away. Defined in PricingProtocol.cpp,
+// which the client library and the server both link
+bool read_frame(const int fd, void *data, const std::size_t n);
+bool write_frame(const int fd, const void *data, const std::size_t n);
@@ -0,0 +1,418 @@
+#pragma once
+#include "MCLib.h"
+#include <cmath>
+#include <functional>
+
+// The engines in MCLib.h block until the whole simulation is done. The PricingScheduler sits on top of the
+// ThreadPool instead: pricings are submitted as jobs and come back as a PricingFuture, jobs are cut into chunks of
+// paths, and the pool's workers pick chunks from the highest priority jobs, round robin among jobs of equal
+// priority, so concurrent pricings share the workers fairly. Between chunks a job can be cancelled, and after
+// every chunk it can report progress with its running estimate.
+
+// the running (or final) estimate of a pricing: the mean of each payoff over the paths done so far and its
+// standard error
+struct PricingEstimate {
+  size_t paths_done{0};
+  std::vector<double> mean;
+  std::vector<double> standard_error;
+};
+
+struct PricingResult : PricingEstimate {
+  bool cancelled{false};
+};
+
+struct PricingConfig {
+  size_t num_paths{0};
+  size_t chunk_size{1024};
+
+  // higher priorities are always served first
+  int priority{0};
+
+  // called after each chunk with the running estimate. Calls for one job never overlap, come in order of
+  // increasing paths_done, and all of them have returned by the time the future becomes ready.
+  std::function<void(const PricingEstimate &)> on_progress;
+};
+
+class PricingScheduler;
+class PricingFuture;
+
+namespace pricing_scheduler_detail {
+
+// per chunk sums, so the final result can be combined in chunk order no matter who ran which chunk
+struct ChunkSums {
+  bool done{false};
+  size_t paths{0};
+  std::vector<double> sum;
+  std::vector<double> sum_of_squares;
+};
+
+struct Scratch {
+  std::vector<double> gaussian_vector;
+  std::vector<Scenario<double>> paths;
+  std::vector<std::vector<double>> payoffs;
+  std::unique_ptr<RNG> generator;
+  size_t rng_position{0};
+};
+
+inline void estimate_from_sums(const size_t paths, const std::vector<double> &sum,
+                               const std::vector<double> &sum_of_squares, PricingEstimate &estimate) {
+  estimate.paths_done = paths;
+  estimate.mean.assign(sum.size(), 0.0);
+  estimate.standard_error.assign(sum.size(), 0.0);
+  if (paths == 0) return;
+  for (size_t j = 0; j < sum.size(); ++j) {
+    const double mean = sum[j] / paths;
+    estimate.mean[j] = mean;
+    if (paths > 1) {
+      const double variance = std::max(0.0, (sum_of_squares[j] - paths * mean * mean) / (paths - 1));
+      estimate.standard_error[j] = std::sqrt(variance / paths);
+    }
+  }
+}
+
+class Job {
+  friend class ::PricingScheduler;
+  friend class ::PricingFuture;
+
+  std::unique_ptr<Instrument<double>> instrument_;
+  std::unique_ptr<FinancialModel<double>> model_;
+  std::unique_ptr<RNG> rng_;
+  PricingConfig config_;
+  size_t number_of_chunks_;
+
+  // dispatch state, guarded by the schedulers mutex
+  size_t next_chunk_{0};
+  size_t last_served_{0};
+
+  std::atomic<bool> cancelled_{false};
+
+  // completion state, guarded by mutex_
+  std::mutex mutex_;
+  std::condition_variable finished_cv_;
+  std::vector<ChunkSums> chunks_;
+  std::vector<std::unique_ptr<Scratch>> free_scratch_;
+  size_t outstanding_{0};
+  bool dispatch_closed_{false};
+  bool finished_{false};
+  size_t running_paths_{0};
+  std::vector<double> running_sum_;
+  std::vector<double> running_sum_of_squares_;
+  PricingResult result_;
+
+  // serializes the progress callbacks together with the running sums they report, so every call sees more paths
+  // than the one before
+  std::mutex progress_mutex_;
+
+  // must be called with mutex_ held
+  void finish() {
+    const size_t n = instrument_->number_of_payoffs();
+    std::vector<double> sum(n, 0.0), sum_of_squares(n, 0.0);
+    size_t paths = 0;
+    for (const auto &chunk : chunks_) {
+      if (!chunk.done) continue;
+      paths += chunk.paths;
+      for (size_t j = 0; j < n; ++j) {
+        sum[j] += chunk.sum[j];
+        sum_of_squares[j] += chunk.sum_of_squares[j];
+      }
+    }
+    estimate_from_sums(paths, sum, sum_of_squares, result_);
+    result_.cancelled = paths < config_.num_paths;
+    finished_ = true;
+    finished_cv_.notify_all();
+  }
+
+  void close_dispatch() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (dispatch_closed_) return;
+    dispatch_closed_ = true;
+    if (outstanding_ == 0) finish();
+  }
+
+  std::unique_ptr<Scratch> acquire_scratch() {
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      if (!free_scratch_.empty()) {
+        auto scratch = std::move(free_scratch_.back());
+        free_scratch_.pop_back();
+        return scratch;
+      }
+    }
+    auto scratch = std::make_unique<Scratch>();
+    scratch->gaussian_vector.resize(model_->simulation_dimension());
+    scratch->paths.resize(std::min(config_.chunk_size, path_block_size));
+    for (auto &path : scratch->paths) {
+      allocate_path(instrument_->samples_needed(), path);
+      initialize_path(path);
+    }
+    scratch->payoffs.assign(scratch->paths.size(), std::vector<double>(instrument_->number_of_payoffs()));
+    return scratch;
+  }
+
+  void run_chunk(const size_t k) {
+    const size_t first_path = k * config_.chunk_size;
+    const size_t paths = std::min(config_.chunk_size, config_.num_paths - first_path);
+    const size_t n = instrument_->number_of_payoffs();
+
+    ChunkSums sums;
+    sums.sum.assign(n, 0.0);
+    sums.sum_of_squares.assign(n, 0.0);
+
+    if (!cancelled_) {
+      auto scratch = acquire_scratch();
+      // generators only move forward, a scratch whose rng is already past this chunk starts over from the seed
+      if (!scratch->generator || scratch->rng_position > first_path) {
+        scratch->generator = rng_->clone();
+        scratch->generator->initialize(model_->simulation_dimension());
+        scratch->rng_position = 0;
+      }
+      scratch->generator->jump_ahead(first_path - scratch->rng_position);
+
+      for (size_t first = 0; first < paths; first += path_block_size) {
+        const size_t count = std::min(path_block_size, paths - first);
+        for (size_t i = 0; i < count; ++i) {
+          scratch->generator->get_gaussians(scratch->gaussian_vector);
+          model_->generate_path(scratch->gaussian_vector, scratch->paths[i]);
+        }
+        instrument_->block_payoffs(scratch->paths, count, scratch->payoffs.data());
+        for (size_t i = 0; i < count; ++i) {
+          for (size_t j = 0; j < n; ++j) {
+            sums.sum[j] += scratch->payoffs[i][j];
+            sums.sum_of_squares[j] += scratch->payoffs[i][j] * scratch->payoffs[i][j];
+          }
+        }
+      }
+      scratch->rng_position = first_path + paths;
+      sums.paths = paths;
+      sums.done = true;
+
+      PricingEstimate progress;
+      std::unique_lock<std::mutex> progress_lock(progress_mutex_, std::defer_lock);
+      if (config_.on_progress) progress_lock.lock();
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        free_scratch_.push_back(std::move(scratch));
+        running_paths_ += paths;
+        for (size_t j = 0; j < n; ++j) {
+          running_sum_[j] += sums.sum[j];
+          running_sum_of_squares_[j] += sums.sum_of_squares[j];
+        }
+        if (config_.on_progress) estimate_from_sums(running_paths_, running_sum_, running_sum_of_squares_, progress);
+        chunks_[k] = std::move(sums);
+      }
+
+      if (config_.on_progress) config_.on_progress(progress);
+    }
+
+    std::lock_guard<std::mutex> lk(mutex_);
+    --outstanding_;
+    if (dispatch_closed_ && outstanding_ == 0) finish();
+  }
+
+public:
+  Job(const Instrument<double> &instrument, const FinancialModel<double> &model, const RNG &rng, PricingConfig config)
+      : instrument_(instrument.clone()), model_(model.clone()), rng_(rng.clone()), config_(std::move(config)) {
+    config_.chunk_size = std::max<size_t>(config_.chunk_size, 1);
+    number_of_chunks_ = (config_.num_paths + config_.chunk_size - 1) / config_.chunk_size;
+    chunks_.resize(number_of_chunks_);
+
+    // the model is set up once per job, every chunk shares it through its const member functions
+    model_->allocate(instrument_->timeline(), instrument_->samples_needed());
+    model_->initialize(instrument_->timeline(), instrument_->samples_needed());
+
+    running_sum_.assign(instrument_->number_of_payoffs(), 0.0);
+    running_sum_of_squares_.assign(instrument_->number_of_payoffs(), 0.0);
+  }
+};
+
+// what a future knows of its scheduler. The scheduler clears it on destruction, after waiting for the futures
+// that are helping, so a future used after its scheduler is gone only waits on its (by then finished) job
+struct SchedulerLink {
+  std::mutex mutex;
+  std::condition_variable helpers_done;
+  PricingScheduler *scheduler{nullptr};
+  size_t helpers{0};
+};
+
+} // namespace pricing_scheduler_detail
+
+// A handle on a submitted pricing. get() does not just block, the calling thread works on its own job's chunks
+// until there are none left to hand out, so pricings complete even when the pool has no workers.
+class PricingFuture {
+  friend class PricingScheduler;
+  using Job = pricing_scheduler_detail::Job;
+  using SchedulerLink = pricing_scheduler_detail::SchedulerLink;
+
+  std::shared_ptr<Job> job_;
+  std::shared_ptr<SchedulerLink> link_;
+
+  PricingFuture(std::shared_ptr<Job> job, std::shared_ptr<SchedulerLink> link)
+      : job_(std::move(job)), link_(std::move(link)) {}
+
+public:
+  // cooperative, chunks already running finish, no new ones start
+  void cancel() { job_->cancelled_ = true; }
+
+  bool ready() const {
+    std::lock_guard<std::mutex> lk(job_->mutex_);
+    return job_->finished_;
+  }
+
+  void wait();
+
+  // the result over every chunk that ran, combined in chunk order so it does not depend on scheduling
+  PricingResult get() {
+    wait();
+    std::lock_guard<std::mutex> lk(job_->mutex_);
+    return job_->result_;
+  }
+};
+
+class PricingScheduler {
+  friend class PricingFuture;
+  using Job = pricing_scheduler_detail::Job;
+  using SchedulerLink = pricing_scheduler_detail::SchedulerLink;
+
+  ThreadPool *pool_;
+  std::shared_ptr<SchedulerLink> link_;
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Job>> jobs_;
+  size_t ticks_{0};
+  size_t runners_active_{0};
+
+  // runners are pool tasks that keep taking chunks until there is no work left
+  TaskLatch runners_;
+  std::function<void(const size_t)> runner_;
+
+  // must be called with mutex_ held. picks the next chunk to run: highest priority first, and among equal
+  // priorities the job that was served least recently. Cancelled and fully dispatched jobs leave the list.
+  std::pair<std::shared_ptr<Job>, size_t> pick(const Job *only = nullptr) {
+    std::shared_ptr<Job> best;
+    for (auto it = jobs_.begin(); it != jobs_.end();) {
+      if ((*it)->cancelled_) {
+        (*it)->close_dispatch();
+        it = jobs_.erase(it);
+        continue;
+      }
+      const auto &job = *it;
+      if (!only || job.get() == only) {
+        if (!best || job->config_.priority > best->config_.priority ||
+            (job->config_.priority == best->config_.priority && job->last_served_ < best->last_served_))
+          best = job;
+      }
+      ++it;
+    }
+    if (!best) return {nullptr, 0};
+
+    const size_t k = best->next_chunk_++;
+    best->last_served_ = ++ticks_;
+    {
+      std::lock_guard<std::mutex> lk(best->mutex_);
+      ++best->outstanding_;
+    }
+    if (best->next_chunk_ == best->number_of_chunks_) {
+      best->close_dispatch();
+      jobs_.erase(std::find(jobs_.begin(), jobs_.end(), best));
+    }
+    return {best, k};
+  }
+
+  void run_until_idle() {
+    while (true) {
+      std::pair<std::shared_ptr<Job>, size_t> work;
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        work = pick();
+        if (!work.first) {
+          --runners_active_;
+          return;
+        }
+      }
+      work.first->run_chunk(work.second);
+    }
+  }
+
+  // runs chunks of job on the calling thread until all of them have been handed out
+  void help(Job &job) {
+    while (true) {
+      std::pair<std::shared_ptr<Job>, size_t> work;
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        work = pick(&job);
+      }
+      if (!work.first) return;
+      work.first->run_chunk(work.second);
+    }
+  }
+
+public:
+  explicit PricingScheduler(ThreadPool *pool = ThreadPool::get_instance())
+      : pool_(pool), link_(std::make_shared<SchedulerLink>()) {
+    link_->scheduler = this;
+    pool_->start();
+    runner_ = [this](const size_t) { run_until_idle(); };
+  }
+
+  PricingScheduler(const PricingScheduler &rhs) = delete;
+  PricingScheduler &operator=(const PricingScheduler &rhs) = delete;
+
+  // outstanding jobs are cancelled and closed, and we wait for helping futures and for the runners to leave
+  // before the scheduler goes away, so every job is finished by then. Waiting on runners_ only runs the runner
+  // tasks themselves, never unrelated work that happens to be queued on the pool.
+  ~PricingScheduler() {
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      for (auto &job : jobs_) job->cancelled_ = true;
+    }
+    {
+      std::unique_lock<std::mutex> lk(link_->mutex);
+      link_->scheduler = nullptr;
+      link_->helpers_done.wait(lk, [this] { return link_->helpers == 0; });
+    }
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      for (auto &job : jobs_) job->close_dispatch();
+      jobs_.clear();
+    }
+    pool_->wait(runners_);
+  }
+
+  // the instrument, model and rng are cloned, the caller is free to reuse or destroy them right away
+  PricingFuture submit(const Instrument<double> &instrument, const FinancialModel<double> &model, const RNG &rng,
+                       PricingConfig config) {
+    auto job = std::make_shared<Job>(instrument, model, rng, std::move(config));
+    if (job->number_of_chunks_ == 0) {
+      job->close_dispatch();
+      return PricingFuture(job, link_);
+    }
+
+    size_t new_runners = 0;
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      job->last_served_ = ticks_;
+      jobs_.push_back(job);
+      const size_t idle = pool_->number_of_threads() - std::min(pool_->number_of_threads(), runners_active_);
+      new_runners = std::min(idle, job->number_of_chunks_);
+      runners_active_ += new_runners;
+    }
+    pool_->spawn_bulk(new_runners, runner_, runners_);
+    return PricingFuture(job, link_);
+  }
+};
+
+inline void PricingFuture::wait() {
+  PricingScheduler *scheduler = nullptr;
+  {
+    std::lock_guard<std::mutex> lk(link_->mutex);
+    scheduler = link_->scheduler;
+    if (scheduler) ++link_->helpers;
+  }
+  if (scheduler) {
+    scheduler->help(*job_);
+    std::lock_guard<std::mutex> lk(link_->mutex);
+    if (--link_->helpers == 0) link_->helpers_done.notify_all();
+  }
+  std::unique_lock<std::mutex> lk(job_->mutex_);
+  job_->finished_cv_.wait(lk, [this] { return job_->finished_; });
+}
@@ -0,0 +1,205 @@
+#pragma once
+#include "PricingProtocol.h"
+#include "PricingScheduler.h"
+#include "FinancialModels.h"
+#include "Instruments.h"
+#include "RNGs.h"
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A resident pricing server. For small on demand pricings the cost of starting the ThreadPool and of initialising
+// the model dominates the simulation itself, so the server keeps the pool running and keeps one warm model: a
+// request only moves its parameters, and the models table cache (which its clones share, and which keeps the most
+// recently used trade shapes and parameters only) hands back tables already built, or only recomputes the ones
+// that depend on what moved.
+// Requests arrive over a Unix domain socket in the frames described in PricingProtocol.h.
+class PricingServer {
+  std::string socket_path_;
+  int listen_fd_{-1};
+  std::atomic<bool> stopping_{false};
+
+  PricingScheduler scheduler_;
+  const size_t chunk_size_;
+  const size_t max_paths_;
+
+  // the warm black scholes model, its memory is bounded by the LRU capacity of its table cache
+  std::mutex model_mutex_;
+  BlackScholesModel<double> warm_model_{100.0, 0.2};
+
+  struct Connection {
+    std::thread thread;
+    std::shared_ptr<std::atomic<bool>> finished;
+  };
+  std::mutex connections_mutex_;
+  std::vector<Connection> connections_;
+  std::vector<int> connection_fds_;
+
+  // both rngs jump ahead exactly (see RNG::jump_ahead), so a chunked pricing is the same whichever rng is asked for
+  bool valid(const PricingRequest &request) const {
+    const bool finite = std::isfinite(request.spot) && std::isfinite(request.vol) && std::isfinite(request.rate) &&
+                        std::isfinite(request.div) && std::isfinite(request.strike) &&
+                        std::isfinite(request.expiration);
+    return request.magic == pricing_request_magic && request.version == pricing_protocol_version &&
+           request.model == PricingModelKind::black_scholes &&
+           request.instrument == PricingInstrumentKind::european_call &&
+           (request.rng == PricingRngKind::mersenne_twist || request.rng == PricingRngKind::pcg) && finite &&
+           request.num_paths > 0 && request.num_paths <= max_paths_ && request.spot > 0.0 && request.vol >= 0.0 && request.expiration > 0.0;
+  }
+
+  PricingResponse price(const PricingRequest &request) {
+    PricingResponse response;
+    response.request_id = request.request_id;
+    if (!valid(request)) {
+      response.status = PricingStatus::bad_request;
+      return response;
+    }
+
+    EuropeanCall<double> call{request.strike, request.expiration};
+    std::unique_ptr<RNG> rng;
+    if (request.rng == PricingRngKind::pcg) rng = std::make_unique<PCGRNG>(request.seed);
+    else rng = std::make_unique<MersenneTwistRNG>(request.seed);
+
+    PricingConfig config;
+    config.num_paths = request.num_paths;
+    config.chunk_size = chunk_size_;
+
+    // the job clones the warm model, so the lock is only held while we move its parameters
+    std::optional<PricingFuture> future;
+    {
+      std::lock_guard<std::mutex> lk(model_mutex_);
+      const auto &parameters = warm_model_.parameters();
+      *parameters[0] = request.spot;
+      *parameters[1] = request.vol;
+      *parameters[2] = request.rate;
+      *parameters[3] = request.div;
+      future.emplace(scheduler_.submit(call, warm_model_, *rng, config));
+    }
+
+    const auto result = future->get();
+    response.paths_done = result.paths_done;
+    response.price = result.mean[0];
+    response.standard_error = result.standard_error[0];
+    return response;
+  }
+
+  void serve(const int fd) {
+    PricingRequest request;
+    while (read_frame(fd, &request, sizeof(request))) {
+      const auto start = std::chrono::steady_clock::now();
+      PricingResponse response;
+      try {
+        response = price(request);
+      } catch (const std::exception &) {
+        response = PricingResponse{};
+        response.request_id = request.request_id;
+        response.status = PricingStatus::error;
+      }
+      response.server_microseconds =
+          std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+      if (!write_frame(fd, &response, sizeof(response))) break;
+    }
+
+    std::lock_guard<std::mutex> lk(connections_mutex_);
+    connection_fds_.erase(std::find(connection_fds_.begin(), connection_fds_.end(), fd));
+    ::close(fd);
+  }
+
+  // joins the threads of connections that have hung up, must be called with connections_mutex_ held
+  void reap() {
+    for (auto it = connections_.begin(); it != connections_.end();) {
+      if (*it->finished) {
+        it->thread.join();
+        it = connections_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+public:
+  // binds and listens straight away, so clients can connect as soon as the constructor returns
+  // a single request can't ask for more than max_paths paths, one small frame should not be able to tie the
+  // workers up (or allocate its results) for ever
+  static constexpr size_t default_max_paths = size_t{1} << 27;
+
+  explicit PricingServer(std::string socket_path, const size_t chunk_size = 1024,
+                         const size_t max_paths = default_max_paths)
+      : socket_path_(std::move(socket_path)), chunk_size_(chunk_size), max_paths_(max_paths) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(address.sun_path)) throw std::runtime_error("PricingServer: socket path too long");
+    std::memcpy(address.sun_path, socket_path_.c_str(), socket_path_.size() + 1);
+
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) throw std::runtime_error("PricingServer: cannot create socket");
+    ::unlink(socket_path_.c_str());
+    if (::bind(listen_fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+        ::listen(listen_fd_, SOMAXCONN) != 0) {
+      ::close(listen_fd_);
+      throw std::runtime_error("PricingServer: cannot listen on " + socket_path_);
+    }
+  }
+
+  PricingServer(const PricingServer &rhs) = delete;
+  PricingServer &operator=(const PricingServer &rhs) = delete;
+
+  ~PricingServer() {
+    request_stop();
+    std::vector<Connection> connections;
+    {
+      std::lock_guard<std::mutex> lk(connections_mutex_);
+      for (const int fd : connection_fds_) ::shutdown(fd, SHUT_RDWR);
+      connections.swap(connections_);
+    }
+    for (auto &connection : connections) connection.thread.join();
+    ::close(listen_fd_);
+    ::unlink(socket_path_.c_str());
+  }
+
+  // accepts connections, each served on its own thread, until request_stop() is called. Failed accepts are
+  // retried, after a growing pause when we are out of descriptors or memory, only a listening socket that is
+  // gone for good ends the loop
+  void run() {
+    auto backoff = std::chrono::milliseconds(1);
+    while (!stopping_) {
+      const int fd = ::accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) {
+        const int error = errno;
+        if (stopping_ || error == EBADF || error == EINVAL || error == ENOTSOCK) break;
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+          std::this_thread::sleep_for(backoff);
+          backoff = std::min(2 * backoff, std::chrono::milliseconds(1000));
+        }
+        continue;
+      }
+      backoff = std::chrono::milliseconds(1);
+
+      std::lock_guard<std::mutex> lk(connections_mutex_);
+      reap();
+      if (stopping_) {
+        ::close(fd);
+        break;
+      }
+      connection_fds_.push_back(fd);
+      auto finished = std::make_shared<std::atomic<bool>>(false);
+      connections_.push_back(Connection{std::thread([this, fd, finished]() {
+                                          serve(fd);
+                                          *finished = true;
+                                        }),
+                                        finished});
+    }
+  }
+
+  // async signal safe, makes run() return. Open connections are closed by the destructor
+  void request_stop() {
+    stopping_ = true;
+    ::shutdown(listen_fd_, SHUT_RDWR);
+  }
+};
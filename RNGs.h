@@ -1,22 +1,23 @@
 #pragma once
 #include "MCLib.h"
 #include <random>
+#include <cmath>
 #include "pcg_random.hpp"
 
 
 // A classic Mersenne twist RNG. 
 class MersenneTwistRNG : public RNG {
-  int seed_{42};
+  std::uint64_t seed_{42};
   std::mt19937_64 generator_;
   std::normal_distribution<double> distribution_{0.0, 1.0};
-  size_t dimension_;
+  size_t dimension_{0};
 
   // store a cache for antithetic sampling
   std::vector<double> cached_values_;
   bool antithetic_flag_{false};
 
 public:
-  MersenneTwistRNG(int seed = 42): seed_(seed), generator_(seed) {}
+  MersenneTwistRNG(std::uint64_t seed = 42): seed_(seed), generator_(seed) {}
 
   // introduce the RNG to the model so we know how many gaussians our model plans on consuming each iteration
   void initialize(const size_t simulation_dimension) override {
@@ -46,29 +47,62 @@ public:
     return std::make_unique<MersenneTwistRNG>(*this);
   }
 
-  virtual void jump_ahead(const unsigned steps) override {
-    std::vector<double> trash(simulation_dimension());
-    for(auto i = 0; i < steps; ++i) get_gaussians(trash);
+  // linear in steps, the normal distribution takes a varying number of raw draws per gaussian so they can't be
+  // skipped. Only the fresh half of each antithetic pair is generated, the negated half costs nothing
+  virtual void jump_ahead(const size_t steps) override {
+    for (size_t i = 0; i < steps; ++i) {
+      if (!antithetic_flag_)
+        std::generate(cached_values_.begin(), cached_values_.end(), [&] { return distribution_(generator_); });
+      antithetic_flag_ = !antithetic_flag_;
+    }
   }
 
 
   size_t simulation_dimension() const override { return dimension_; }
+
+  void append_key(PricingKey &key) const override {
+    key.add("MersenneTwist");
+    key.add(static_cast<std::uint64_t>(seed_));
+  }
 };
 
 
 // Apparently the PCG family of RNG's are the state of the art for monte carlo simulations, although it doesn't seem like many finance
 // books/repositories use them. 
+//
+// PCG can advance its stream in O(log n), but that only helps if we know exactly how many raw draws a path uses,
+// which a rejection sampler like std::normal_distribution doesn't tell us. So the gaussians come from Box-Muller
+// instead, every pair of them takes exactly four 32 bit draws (two 53 bit uniforms), and jump_ahead lands exactly
+// where the skipped get_gaussians calls would have left the stream.
 class PCGRNG : public RNG{
-  long unsigned seed_{42};
+  std::uint64_t seed_{42};
   pcg32 generator_;
-  std::normal_distribution<double> distribution_{0.0, 1.0};
 
-  size_t dimension_;
+  size_t dimension_{0};
   std::vector<double> cached_values_;
   bool antithetic_flag_{false};
 
+  static constexpr std::uint64_t draws_per_pair = 4;
+
+  // a uniform in (0, 1], never 0 so its log is finite
+  double uniform() {
+    const std::uint64_t hi = generator_();
+    const std::uint64_t lo = generator_();
+    return (static_cast<double>(((hi << 32) | lo) >> 11) + 1.0) * 0x1.0p-53;
+  }
+
+  void generate() {
+    constexpr double two_pi = 6.283185307179586;
+    for (size_t i = 0; i < dimension_; i += 2) {
+      const double radius = std::sqrt(-2.0 * std::log(uniform()));
+      const double angle = two_pi * uniform();
+      cached_values_[i] = radius * std::cos(angle);
+      if (i + 1 < dimension_) cached_values_[i + 1] = radius * std::sin(angle);
+    }
+  }
+
 public:
-  PCGRNG(int seed = 42): seed_(seed), generator_{seed_} {}
+  PCGRNG(std::uint64_t seed = 42): seed_(seed), generator_{seed_} {}
 
   void initialize(const size_t simulation_dimension) override {
     dimension_ = simulation_dimension;
@@ -82,16 +116,23 @@ public:
                      [](const double n) { return -n; });
       antithetic_flag_ = false;
     } else {
-      std::generate(cached_values_.begin(), cached_values_.end(),
-                    [&] { return distribution_(generator_); });
+      generate();
       std::copy(cached_values_.begin(), cached_values_.end(),
                 gaussian_vector.begin());
       antithetic_flag_ = true;
     }
   }
 
-  void jump_ahead(const unsigned steps) override {
-    generator_.advance((steps * simulation_dimension())/2);
+  // the skipped calls alternate between fresh vectors and negated ones, only the fresh ones draw. If we stop
+  // right after a fresh one the next call negates it, so that one is generated rather than skipped
+  void jump_ahead(const size_t steps) override {
+    if (steps == 0) return;
+    const size_t fresh = antithetic_flag_ ? steps / 2 : (steps + 1) / 2;
+    const bool ends_on_fresh = antithetic_flag_ != (steps % 2 == 1);
+    const std::uint64_t draws_per_vector = draws_per_pair * ((dimension_ + 1) / 2);
+    generator_.advance(draws_per_vector * (fresh - (ends_on_fresh ? 1 : 0)));
+    if (ends_on_fresh) generate();
+    antithetic_flag_ = ends_on_fresh;
   }
 
   std::unique_ptr<RNG> clone() const override {
@@ -101,4 +142,8 @@ public:
 
   size_t simulation_dimension() const override { return dimension_; }
 
+  void append_key(PricingKey &key) const override {
+    key.add("PCG");
+    key.add(static_cast<std::uint64_t>(seed_));
+  }
 };
\ No newline at end of file
@@ -0,0 +1,681 @@
+#pragma once
+#include "MCLib.h"
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+
+// A small payoff language, so that new products can be described by structurers instead of written as a new
+// Instrument subclass. A script is parsed once, its timeline and SampleDefs are derived from the event dates it
+// uses, and it is compiled to a compact bytecode that is evaluated over a whole block of paths at a time.
+//
+//   # an up and out call with a rebate, monitored quarterly
+//   K = 100
+//   B = 130
+//   alive = 1
+//   on 0.25: if spot >= B then alive = 0 end
+//   on 0.50: if spot >= B then alive = 0 end
+//   on 0.75: if spot >= B then alive = 0 end
+//   on 1.00:
+//     if alive then pay max(spot - K, 0) else pay 2 end
+//
+// Statements before the first "on" set up variables, after "on <date>" they run on that date, in date order.
+//
+//   name = expr           assignment
+//   name += expr          accumulation
+//   pay expr              pays expr on the current date, it is discounted by that dates numeraire
+//   if expr then ... [else ...] end
+//
+// Expressions have numbers, variables, spot (the underlying on the current date), + - * /, comparisons
+// < <= > >= == !=, and/or/not, and the functions max(a, b), min(a, b), abs, exp, log and sqrt. Anything non
+// zero is true. The instrument has a single payoff, the sum of everything it pays.
+//
+// The bytecode is a stack machine in which every slot holds one value per path of the block, so each instruction
+// is a short loop over the block that the compiler vectorises. Control flow is predicated rather than branched:
+// an if narrows a per path mask, and assignments and payments only take effect where the mask is set, so every
+// path of a block runs the exact same instructions.
+
+namespace scripted_detail {
+
+enum class Op : std::uint8_t {
+  push_const, load_var, load_spot,
+  add, sub, mul, div, neg,
+  lt, le, gt, ge, eq, ne, logical_and, logical_or, logical_not,
+  max, min, abs, exp, log, sqrt,
+  store, accumulate, pay,
+  begin_if, begin_else, end_if
+};
+
+struct Instruction {
+  Op op;
+  // variable index for load_var/store/accumulate, event index for load_spot/pay
+  std::uint32_t arg{0};
+  double value{0.0};
+  // set on binary operations whose right hand side was a constant, which is then in value instead of on the stack
+  bool constant_rhs{false};
+  // set on such operations when their left hand side is the spot on event arg, which is then read straight from
+  // the paths instead of being pushed first
+  bool spot_lhs{false};
+  // set on the first pay when it is outside of any if, it then sets the payoff instead of adding to it
+  bool assign{false};
+  // a pay whose amount was a binary operation with a constant right hand side applies it itself, this is the op
+  Op pay_op{Op::push_const};
+};
+
+struct Program {
+  std::vector<double> dates;
+  std::vector<bool> pays_on;
+  std::vector<std::string> variables;
+  // the variables the optimised code still touches, the others were folded into constants
+  std::vector<std::uint32_t> live_variables;
+  std::vector<Instruction> code;
+  size_t stack_depth{0};
+  size_t if_depth{0};
+  // whether the payoff is set by an assigning pay before anything adds to it, and whether that is the only pay, in
+  // which case it writes straight into the callers payoffs
+  bool first_pay_assigns{false};
+  bool pays_directly{false};
+};
+
+enum class Tok { number, ident, symbol, end };
+
+struct Token {
+  Tok kind;
+  std::string text;
+  double number{0.0};
+  int line{1};
+};
+
+inline std::vector<Token> lex(const std::string &source) {
+  std::vector<Token> tokens;
+  int line = 1;
+  size_t i = 0;
+  while (i < source.size()) {
+    const char c = source[i];
+    if (c == '\n') {
+      ++line;
+      ++i;
+    } else if (std::isspace(static_cast<unsigned char>(c))) {
+      ++i;
+    } else if (c == '#') {
+      while (i < source.size() && source[i] != '\n') ++i;
+    } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+      // digits, an optional fraction and an optional exponent, only that much is handed to the conversion
+      auto digits = [&](size_t j) {
+        while (j < source.size() && std::isdigit(static_cast<unsigned char>(source[j]))) ++j;
+        return j;
+      };
+      size_t end = digits(i);
+      if (end < source.size() && source[end] == '.') end = digits(end + 1);
+      if (end < source.size() && (source[end] == 'e' || source[end] == 'E')) {
+        size_t exponent = end + 1;
+        if (exponent < source.size() && (source[exponent] == '+' || source[exponent] == '-')) ++exponent;
+        if (digits(exponent) > exponent) end = digits(exponent);
+      }
+
+      double x = 0.0;
+      const auto [last, error] = std::from_chars(source.data() + i, source.data() + end, x);
+      if (error != std::errc() || last != source.data() + end)
+        throw std::runtime_error("ScriptedInstrument: line " + std::to_string(line) + ": malformed number");
+      tokens.push_back(Token{Tok::number, source.substr(i, end - i), x, line});
+      i = end;
+    } else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+      const size_t start = i;
+      while (i < source.size() && (std::isalnum(static_cast<unsigned char>(source[i])) || source[i] == '_')) ++i;
+      tokens.push_back(Token{Tok::ident, source.substr(start, i - start), 0.0, line});
+    } else {
+      static const char *two_char[] = {"<=", ">=", "==", "!=", "+="};
+      std::string symbol(1, c);
+      for (const auto *op : two_char)
+        if (source.compare(i, 2, op) == 0) symbol = op;
+      if (symbol.size() == 1 && std::string("+-*/(),:=<>").find(c) == std::string::npos)
+        throw std::runtime_error("ScriptedInstrument: line " + std::to_string(line) + ": unexpected '" + symbol + "'");
+      tokens.push_back(Token{Tok::symbol, symbol, 0.0, line});
+      i += symbol.size();
+    }
+  }
+  tokens.push_back(Token{Tok::end, "", 0.0, line});
+  return tokens;
+}
+
+// recursive descent straight to bytecode
+class Compiler {
+  std::vector<Token> tokens_;
+  size_t pos_{0};
+  Program program_;
+  std::map<std::string, std::uint32_t> variables_;
+  // the event the statements being compiled run on, -1 before the first "on"
+  int event_{-1};
+  size_t depth_{0};
+  size_t open_ifs_{0};
+  // where the first event starts in the code, everything before it is the set up of the variables
+  size_t prelude_end_{0};
+
+  const Token &peek() const { return tokens_[pos_]; }
+  const Token &next() { return tokens_[pos_++]; }
+
+  [[noreturn]] void fail(const std::string &what) const {
+    throw std::runtime_error("ScriptedInstrument: line " + std::to_string(peek().line) + ": " + what);
+  }
+
+  bool at_symbol(const char *s) const { return peek().kind == Tok::symbol && peek().text == s; }
+  bool at_keyword(const char *s) const { return peek().kind == Tok::ident && peek().text == s; }
+
+  void expect_symbol(const char *s) {
+    if (!at_symbol(s)) fail(std::string("expected '") + s + "'");
+    ++pos_;
+  }
+
+  void expect_keyword(const char *s) {
+    if (!at_keyword(s)) fail(std::string("expected '") + s + "'");
+    ++pos_;
+  }
+
+  static bool is_keyword(const std::string &s) {
+    return s == "on" || s == "pay" || s == "if" || s == "then" || s == "else" || s == "end" || s == "and" ||
+           s == "or" || s == "not" || s == "spot";
+  }
+
+  // keeps track of how deep the value stack gets
+  void emit(const Op op, const std::uint32_t arg = 0, const double value = 0.0) {
+    switch (op) {
+    case Op::push_const: case Op::load_var: case Op::load_spot:
+      program_.stack_depth = std::max(program_.stack_depth, ++depth_);
+      break;
+    case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::lt: case Op::le: case Op::gt: case Op::ge:
+    case Op::eq: case Op::ne: case Op::logical_and: case Op::logical_or: case Op::max: case Op::min:
+    case Op::store: case Op::accumulate: case Op::pay: case Op::begin_if:
+      --depth_;
+      break;
+    default:
+      break;
+    }
+    program_.code.push_back(Instruction{op, arg, value});
+  }
+
+  void primary() {
+    const Token &t = next();
+    if (t.kind == Tok::number) {
+      emit(Op::push_const, 0, t.number);
+    } else if (t.kind == Tok::symbol && t.text == "(") {
+      expression();
+      expect_symbol(")");
+    } else if (t.kind == Tok::ident && t.text == "spot") {
+      if (event_ < 0) fail("spot is only known on an event date");
+      emit(Op::load_spot, static_cast<std::uint32_t>(event_));
+    } else if (t.kind == Tok::ident && at_symbol("(")) {
+      static const std::map<std::string, std::pair<Op, int>> functions = {
+          {"max", {Op::max, 2}}, {"min", {Op::min, 2}}, {"abs", {Op::abs, 1}},
+          {"exp", {Op::exp, 1}}, {"log", {Op::log, 1}}, {"sqrt", {Op::sqrt, 1}}};
+      auto it = functions.find(t.text);
+      if (it == functions.end()) fail("unknown function " + t.text);
+      expect_symbol("(");
+      expression();
+      for (int i = 1; i < it->second.second; ++i) {
+        expect_symbol(",");
+        expression();
+      }
+      expect_symbol(")");
+      emit(it->second.first);
+    } else if (t.kind == Tok::ident && !is_keyword(t.text)) {
+      auto it = variables_.find(t.text);
+      if (it == variables_.end()) fail("variable " + t.text + " is used before it is assigned");
+      emit(Op::load_var, it->second);
+    } else {
+      --pos_;
+      fail("expected an expression");
+    }
+  }
+
+  void unary() {
+    if (at_symbol("-")) {
+      ++pos_;
+      unary();
+      emit(Op::neg);
+    } else {
+      primary();
+    }
+  }
+
+  void term() {
+    unary();
+    while (at_symbol("*") || at_symbol("/")) {
+      const bool mul = next().text == "*";
+      unary();
+      emit(mul ? Op::mul : Op::div);
+    }
+  }
+
+  void arithmetic() {
+    term();
+    while (at_symbol("+") || at_symbol("-")) {
+      const bool add = next().text == "+";
+      term();
+      emit(add ? Op::add : Op::sub);
+    }
+  }
+
+  void comparison() {
+    arithmetic();
+    static const std::map<std::string, Op> comparisons = {
+        {"<", Op::lt}, {"<=", Op::le}, {">", Op::gt}, {">=", Op::ge}, {"==", Op::eq}, {"!=", Op::ne}};
+    if (peek().kind == Tok::symbol) {
+      auto it = comparisons.find(peek().text);
+      if (it != comparisons.end()) {
+        ++pos_;
+        arithmetic();
+        emit(it->second);
+      }
+    }
+  }
+
+  void negation() {
+    if (at_keyword("not")) {
+      ++pos_;
+      negation();
+      emit(Op::logical_not);
+    } else {
+      comparison();
+    }
+  }
+
+  void conjunction() {
+    negation();
+    while (at_keyword("and")) {
+      ++pos_;
+      negation();
+      emit(Op::logical_and);
+    }
+  }
+
+  void expression() {
+    conjunction();
+    while (at_keyword("or")) {
+      ++pos_;
+      conjunction();
+      emit(Op::logical_or);
+    }
+  }
+
+  std::uint32_t variable(const std::string &name) {
+    auto it = variables_.find(name);
+    if (it != variables_.end()) return it->second;
+    const auto index = static_cast<std::uint32_t>(program_.variables.size());
+    program_.variables.push_back(name);
+    variables_.emplace(name, index);
+    return index;
+  }
+
+  // true if a statement was compiled, false at the end of a block
+  bool statement() {
+    const Token &t = peek();
+    if (t.kind == Tok::end || at_keyword("else") || at_keyword("end")) return false;
+
+    if (at_keyword("on")) {
+      if (open_ifs_ > 0) fail("'on' inside an if");
+      ++pos_;
+      if (peek().kind != Tok::number) fail("expected a date after 'on'");
+      const double date = next().number;
+      if (date <= 0.0 || (!program_.dates.empty() && date <= program_.dates.back()))
+        fail("event dates must be positive and increasing");
+      if (at_symbol(":")) ++pos_;
+      if (program_.dates.empty()) prelude_end_ = program_.code.size();
+      program_.dates.push_back(date);
+      program_.pays_on.push_back(false);
+      event_ = static_cast<int>(program_.dates.size()) - 1;
+    } else if (at_keyword("pay")) {
+      ++pos_;
+      if (event_ < 0) fail("pay is only allowed on an event date");
+      expression();
+      emit(Op::pay, static_cast<std::uint32_t>(event_));
+      program_.pays_on[event_] = true;
+    } else if (at_keyword("if")) {
+      ++pos_;
+      expression();
+      expect_keyword("then");
+      emit(Op::begin_if);
+      program_.if_depth = std::max(program_.if_depth, ++open_ifs_);
+      while (statement()) {}
+      if (at_keyword("else")) {
+        ++pos_;
+        emit(Op::begin_else);
+        while (statement()) {}
+      }
+      expect_keyword("end");
+      emit(Op::end_if);
+      --open_ifs_;
+    } else if (t.kind == Tok::ident && !is_keyword(t.text)) {
+      const std::string name = next().text;
+      const bool accumulate = at_symbol("+=");
+      if (!accumulate) expect_symbol("=");
+      else ++pos_;
+      if (accumulate && !variables_.count(name)) fail("variable " + name + " is accumulated before it is assigned");
+      expression();
+      emit(accumulate ? Op::accumulate : Op::store, variable(name));
+    } else {
+      fail("expected a statement");
+    }
+    return true;
+  }
+
+  static bool is_binary(const Op op) {
+    return op == Op::add || op == Op::sub || op == Op::mul || op == Op::div || op == Op::lt || op == Op::le ||
+           op == Op::gt || op == Op::ge || op == Op::eq || op == Op::ne || op == Op::logical_and ||
+           op == Op::logical_or || op == Op::max || op == Op::min;
+  }
+
+  // Two peephole passes. Variables that are set once to a constant in the prelude (strikes, barriers, ...) are
+  // replaced by that constant, and a constant pushed right before a binary operation becomes an operand of the
+  // operation, as does a spot pushed right before that. Together they take the loads and the stack traffic out of
+  // most of the arithmetic, and such an operation right before a pay is applied by the pay. Last, a pay that comes
+  // before any other and outside of any if sets the payoff, which saves clearing it, and when it is the only pay it
+  // also saves copying the payoffs out.
+  void optimise() {
+    auto &code = program_.code;
+    const size_t n = program_.variables.size();
+
+    std::vector<int> stores(n, 0);
+    for (const auto &ins : code)
+      if (ins.op == Op::store || ins.op == Op::accumulate) ++stores[ins.arg];
+
+    std::vector<bool> constant(n, false);
+    std::vector<double> value(n, 0.0);
+    std::vector<bool> dead(code.size(), false);
+    int ifs = 0;
+    for (size_t i = 0; i < prelude_end_; ++i) {
+      if (code[i].op == Op::begin_if) ++ifs;
+      if (code[i].op == Op::end_if) --ifs;
+      if (code[i].op == Op::store && ifs == 0 && stores[code[i].arg] == 1 && i > 0 && code[i - 1].op == Op::push_const) {
+        constant[code[i].arg] = true;
+        value[code[i].arg] = code[i - 1].value;
+        dead[i - 1] = dead[i] = true;
+      }
+    }
+
+    std::vector<Instruction> folded;
+    for (size_t i = 0; i < code.size(); ++i) {
+      if (dead[i]) continue;
+      Instruction ins = code[i];
+      if (ins.op == Op::load_var && constant[ins.arg]) ins = Instruction{Op::push_const, 0, value[ins.arg]};
+      if (ins.op == Op::pay && !folded.empty() && folded.back().constant_rhs && !folded.back().spot_lhs) {
+        ins.pay_op = folded.back().op;
+        ins.value = folded.back().value;
+        ins.constant_rhs = true;
+        folded.pop_back();
+      }
+      if (is_binary(ins.op) && !folded.empty() && folded.back().op == Op::push_const) {
+        ins.value = folded.back().value;
+        ins.constant_rhs = true;
+        folded.pop_back();
+        if (!folded.empty() && folded.back().op == Op::load_spot) {
+          ins.arg = folded.back().arg;
+          ins.spot_lhs = true;
+          folded.pop_back();
+        }
+      }
+      folded.push_back(ins);
+    }
+    code = std::move(folded);
+
+    ifs = 0;
+    for (auto &ins : code) {
+      if (ins.op == Op::begin_if) ++ifs;
+      if (ins.op == Op::end_if) --ifs;
+      if (ins.op == Op::pay) {
+        ins.assign = program_.first_pay_assigns = ifs == 0;
+        break;
+      }
+    }
+    const auto pays = std::count_if(code.begin(), code.end(), [](const Instruction &ins) { return ins.op == Op::pay; });
+    program_.pays_directly = program_.first_pay_assigns && pays == 1;
+
+    std::vector<bool> live(n, false);
+    for (const auto &ins : code)
+      if (ins.op == Op::load_var || ins.op == Op::store || ins.op == Op::accumulate) live[ins.arg] = true;
+    for (std::uint32_t v = 0; v < n; ++v)
+      if (live[v]) program_.live_variables.push_back(v);
+  }
+
+public:
+  explicit Compiler(const std::string &source) : tokens_(lex(source)) {}
+
+  Program compile() {
+    while (statement()) {}
+    if (peek().kind != Tok::end) fail("'" + peek().text + "' without a matching if");
+    if (program_.dates.empty()) fail("the script has no event dates");
+    optimise();
+    return std::move(program_);
+  }
+};
+
+} // namespace scripted_detail
+
+template <typename T>
+class ScriptedInstrument : public Instrument<T> {
+  std::string source_;
+  scripted_detail::Program program_;
+
+  const size_t num_payoffs_{1};
+  std::vector<double> timeline_;
+  std::vector<SampleDef<T>> samples_;
+
+  // calls use(f) with the function f(a, b) of a binary op
+  template <typename Use>
+  static void with_binary(const scripted_detail::Op op, Use &&use) {
+    using scripted_detail::Op;
+    auto truth = [](const T &x) { return x != T(0.0); };
+    switch (op) {
+    case Op::add: use([](const T &a, const T &b) { return a + b; }); break;
+    case Op::sub: use([](const T &a, const T &b) { return a - b; }); break;
+    case Op::mul: use([](const T &a, const T &b) { return a * b; }); break;
+    case Op::div: use([](const T &a, const T &b) { return a / b; }); break;
+    case Op::lt: use([](const T &a, const T &b) { return T(a < b ? 1.0 : 0.0); }); break;
+    case Op::le: use([](const T &a, const T &b) { return T(a <= b ? 1.0 : 0.0); }); break;
+    case Op::gt: use([](const T &a, const T &b) { return T(a > b ? 1.0 : 0.0); }); break;
+    case Op::ge: use([](const T &a, const T &b) { return T(a >= b ? 1.0 : 0.0); }); break;
+    case Op::eq: use([](const T &a, const T &b) { return T(a == b ? 1.0 : 0.0); }); break;
+    case Op::ne: use([](const T &a, const T &b) { return T(a != b ? 1.0 : 0.0); }); break;
+    case Op::logical_and: use([=](const T &a, const T &b) { return T(truth(a) && truth(b) ? 1.0 : 0.0); }); break;
+    case Op::logical_or: use([=](const T &a, const T &b) { return T(truth(a) || truth(b) ? 1.0 : 0.0); }); break;
+    case Op::max: use([](const T &a, const T &b) { return a < b ? b : a; }); break;
+    case Op::min: use([](const T &a, const T &b) { return b < a ? b : a; }); break;
+    default: break;
+    }
+  }
+
+  // Everything a block evaluation works in, one row of path_block_size values each: the payoff totals, the
+  // outermost mask (all ones, and never written, so it is set once when the workspace is made), the nested masks
+  // and conditions, the stack and the variables. The instrument is shared by every thread of a simulation so the
+  // workspace is per thread, and one per thread is enough for every script: it only ever grows, and the fixed rows
+  // come first so their layout never depends on the program.
+  struct Workspace {
+    std::vector<T> rows;
+  };
+
+  static T *workspace(const size_t rows) {
+    thread_local Workspace mine;
+    if (mine.rows.size() < rows * path_block_size) mine.rows.resize(rows * path_block_size, T(1.0));
+    return mine.rows.data();
+  }
+
+  size_t workspace_rows() const {
+    return 3 + 2 * program_.if_depth + program_.stack_depth + program_.variables.size();
+  }
+
+  // evaluates the program for the first count of paths, and writes each paths total into its payoffs. Spots and
+  // numeraires are read straight from the paths by the instructions that use them, there is no transposed copy of
+  // the block. The arithmetic runs over N lanes, N being a compile time constant so that those loops have a fixed
+  // trip count, the lanes past count are evaluated on whatever was left there and nobody reads them.
+  template <size_t N>
+  void evaluate(const Scenario<T> *paths, const size_t count, T *rows, std::vector<T> *payoffs) const {
+    using scripted_detail::Op;
+    constexpr size_t B = path_block_size;
+
+    T *payoff = rows;
+    T *masks = rows + B;
+    T *conds = masks + (program_.if_depth + 1) * B;
+    T *stack = conds + (program_.if_depth + 1) * B;
+    T *vars = stack + program_.stack_depth * B;
+
+    for (const auto v : program_.live_variables) std::fill(vars + v * B, vars + v * B + N, T(0.0));
+    if (!program_.first_pay_assigns) std::fill(payoff, payoff + N, T(0.0));
+
+    T *top = stack - B;
+    T *mask = masks;
+    T *cond = conds;
+
+    auto truth = [](const T &x) { return x != T(0.0); };
+    auto unary = [&](auto f) {
+      T *__restrict a = top;
+      for (size_t i = 0; i < N; ++i) a[i] = f(a[i]);
+    };
+    auto binary = [&](const scripted_detail::Instruction &ins, auto f) {
+      if (ins.spot_lhs) {
+        top += B;
+        T *__restrict a = top;
+        const T b = T(ins.value);
+        for (size_t i = 0; i < count; ++i) a[i] = f(paths[i][ins.arg].forwards[0], b);
+      } else if (ins.constant_rhs) {
+        T *__restrict a = top;
+        const T b = T(ins.value);
+        for (size_t i = 0; i < N; ++i) a[i] = f(a[i], b);
+      } else {
+        const T *__restrict b = top;
+        top -= B;
+        T *__restrict a = top;
+        for (size_t i = 0; i < N; ++i) a[i] = f(a[i], b[i]);
+      }
+    };
+    // pays amount(top) discounted on the paths, outside of any if every path pays, which saves the blend
+    auto pay = [&](const scripted_detail::Instruction &ins, auto amount) {
+      const T *__restrict owed = top;
+      const size_t e = ins.arg;
+      if (ins.assign && program_.pays_directly)
+        for (size_t i = 0; i < count; ++i) payoffs[i][0] = amount(owed[i]) / paths[i][e].numeraire;
+      else if (ins.assign)
+        for (size_t i = 0; i < count; ++i) payoff[i] = amount(owed[i]) / paths[i][e].numeraire;
+      else if (mask == masks)
+        for (size_t i = 0; i < count; ++i) payoff[i] += amount(owed[i]) / paths[i][e].numeraire;
+      else
+        for (size_t i = 0; i < count; ++i)
+          payoff[i] = truth(mask[i]) ? payoff[i] + amount(owed[i]) / paths[i][e].numeraire : payoff[i];
+    };
+    auto push = [&](const T *__restrict from) {
+      top += B;
+      T *__restrict to = top;
+      for (size_t i = 0; i < N; ++i) to[i] = from[i];
+    };
+
+    for (const auto &ins : program_.code) {
+      switch (ins.op) {
+      case Op::push_const:
+        top += B;
+        std::fill(top, top + N, T(ins.value));
+        break;
+      case Op::load_var: push(vars + ins.arg * B); break;
+      case Op::load_spot: {
+        top += B;
+        T *__restrict to = top;
+        for (size_t i = 0; i < count; ++i) to[i] = paths[i][ins.arg].forwards[0];
+        break;
+      }
+      case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::lt: case Op::le: case Op::gt: case Op::ge:
+      case Op::eq: case Op::ne: case Op::logical_and: case Op::logical_or: case Op::max: case Op::min:
+        with_binary(ins.op, [&](auto f) { binary(ins, f); });
+        break;
+      case Op::neg: unary([](const T &a) { return -a; }); break;
+      case Op::logical_not: unary([&](const T &a) { return T(truth(a) ? 0.0 : 1.0); }); break;
+      case Op::abs: unary([](const T &a) { return a < T(0.0) ? -a : a; }); break;
+      case Op::exp: unary([](const T &a) { return std::exp(a); }); break;
+      case Op::log: unary([](const T &a) { return std::log(a); }); break;
+      case Op::sqrt: unary([](const T &a) { return std::sqrt(a); }); break;
+      case Op::store: {
+        T *__restrict var = vars + ins.arg * B;
+        if (mask == masks)
+          std::copy(top, top + N, var);
+        else
+          for (size_t i = 0; i < N; ++i) var[i] = truth(mask[i]) ? top[i] : var[i];
+        top -= B;
+        break;
+      }
+      case Op::accumulate: {
+        T *__restrict var = vars + ins.arg * B;
+        if (mask == masks)
+          for (size_t i = 0; i < N; ++i) var[i] += top[i];
+        else
+          for (size_t i = 0; i < N; ++i) var[i] = truth(mask[i]) ? var[i] + top[i] : var[i];
+        top -= B;
+        break;
+      }
+      case Op::pay: {
+        if (ins.constant_rhs)
+          with_binary(ins.pay_op, [&](auto f) {
+            const T b = T(ins.value);
+            pay(ins, [&](const T &a) { return f(a, b); });
+          });
+        else
+          pay(ins, [](const T &a) { return a; });
+        top -= B;
+        break;
+      }
+      case Op::begin_if:
+        // remember the condition for a possible else, and narrow the mask to the paths where it holds
+        cond += B;
+        std::copy(top, top + N, cond);
+        top -= B;
+        mask += B;
+        for (size_t i = 0; i < N; ++i) mask[i] = T(truth(mask[i - B]) && truth(cond[i]) ? 1.0 : 0.0);
+        break;
+      case Op::begin_else:
+        for (size_t i = 0; i < N; ++i) mask[i] = T(truth(mask[i - B]) && !truth(cond[i]) ? 1.0 : 0.0);
+        break;
+      case Op::end_if:
+        mask -= B;
+        cond -= B;
+        break;
+      }
+    }
+
+    if (!program_.pays_directly)
+      for (size_t i = 0; i < count; ++i) payoffs[i][0] = payoff[i];
+  }
+
+public:
+  explicit ScriptedInstrument(std::string source)
+      : source_(std::move(source)), program_(scripted_detail::Compiler(source_).compile()) {
+    timeline_ = program_.dates;
+    samples_.resize(timeline_.size());
+    for (size_t e = 0; e < timeline_.size(); ++e) {
+      samples_[e].numeraire = program_.pays_on[e];
+      samples_[e].forward_maturities.push_back(timeline_[e]);
+    }
+  }
+
+  std::unique_ptr<Instrument<T>> clone() const override {
+    return std::make_unique<ScriptedInstrument<T>>(*this);
+  }
+
+  const std::vector<double> &timeline() const override { return timeline_; }
+
+  const std::vector<SampleDef<T>> &samples_needed() const override { return samples_; }
+
+  size_t number_of_payoffs() const override { return num_payoffs_; }
+
+  // number of bytecode instructions, mostly of interest to tests and benchmarks
+  size_t program_size() const { return program_.code.size(); }
+
+  void payoffs(const Scenario<T> &path, std::vector<T> &payoffs) const override {
+    evaluate<1>(&path, 1, workspace(workspace_rows()), &payoffs);
+  }
+
+  void block_payoffs(const std::vector<Scenario<T>> &paths, const size_t count,
+                     std::vector<T> *payoffs) const override {
+    evaluate<path_block_size>(paths.data(), count, workspace(workspace_rows()), payoffs);
+  }
+
+  void append_key(PricingKey &key) const override {
+    key.add("ScriptedInstrument");
+    key.add(source_);
+  }
+};
@@ -0,0 +1,277 @@
+#pragma once
+#include "MCLib.h"
+#include "PricingScheduler.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+// Large runs can be split across processes (or hosts): each shard simulates a range [first, last) of path
+// indices, positioning its rng with jump_ahead, and writes a snapshot of its accumulators. Merging the
+// snapshots of shards that cover [0, num_paths) gives the same estimate as running the whole range in one go.
+//
+// To make that exact, and not just equal up to rounding, the sums are never accumulated across the whole
+// range. Paths are grouped in fixed accumulation blocks of block_size paths, each block is summed in path order,
+// and the snapshot keeps one partial sum per block. Merging adds the blocks up in index order, which is the
+// same order whether there was one shard or a hundred, as long as shard boundaries fall on block boundaries.
+// That also relies on jump_ahead continuing the stream exactly, which the RNG interface requires of every rng.
+//
+// The cost of a shard's start depends on the rng. The Mersenne Twist rng has to generate every gaussian before
+// first_path, so the last of n shards spends about (n - 1) / n of the run's rng time getting into position (model
+// and payoff work is not repeated). PCG draws a fixed number of words per path and jumps in O(log steps), which
+// makes it the better choice for runs split into many shards.
+//
+// The snapshot format is, in native byte order
+//
+//   header    magic "MCLSHARD", format version, num_paths, first, last, block_size, number of payoffs, key size
+//   key       the PricingKey bytes of the instrument, model and rng, so shards of different runs can't be mixed
+//   blocks    for every block of the shard, its payoff sums followed by its sums of squares
+
+constexpr char shard_snapshot_magic[8] = {'M', 'C', 'L', 'S', 'H', 'A', 'R', 'D'};
+constexpr std::uint32_t shard_snapshot_version = 1;
+
+struct ShardSnapshot {
+  size_t num_paths{0};
+  size_t first_path{0};
+  size_t last_path{0};
+  size_t block_size{0};
+  size_t number_of_payoffs{0};
+  std::string key;
+
+  // block b of the shard covers paths [first_path + b * block_size, ...), its sums are at b * number_of_payoffs
+  std::vector<double> sums;
+  std::vector<double> sums_of_squares;
+
+  size_t number_of_blocks() const {
+    const size_t paths = last_path - first_path;
+    return paths / block_size + (paths % block_size != 0);
+  }
+};
+
+namespace shard_detail {
+
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+  std::uint64_t num_paths;
+  std::uint64_t first_path;
+  std::uint64_t last_path;
+  std::uint64_t block_size;
+  std::uint64_t number_of_payoffs;
+  std::uint64_t key_size;
+};
+
+inline std::string run_key(const Instrument<double> &instrument, const FinancialModel<double> &model,
+                           const RNG &rng) {
+  PricingKey key;
+  instrument.append_key(key);
+  model.append_key(key);
+  rng.append_key(key);
+  return key.bytes();
+}
+
+} // namespace shard_detail
+
+// the range of shard out of shard_count, split as evenly as possible along accumulation block boundaries
+inline std::pair<size_t, size_t> shard_range(const size_t num_paths, const size_t shard, const size_t shard_count,
+                                             const size_t block_size = 4096) {
+  const size_t blocks = (num_paths + block_size - 1) / block_size;
+  const auto boundary = [&](const size_t s) { return std::min(num_paths, blocks * s / shard_count * block_size); };
+  return {boundary(shard), boundary(shard + 1)};
+}
+
+// Simulates paths [first_path, last_path) of a num_paths run on the ThreadPool, one task per accumulation block.
+// The model and rng must be the same (and the rng unadvanced) in every shard of a run.
+inline ShardSnapshot simulate_shard(const Instrument<double> &instrument,
+                                    const FinancialModel<double> &model,
+                                    const RNG &rng,
+                                    const size_t num_paths,
+                                    const size_t first_path,
+                                    const size_t last_path,
+                                    const size_t block_size = 4096) {
+  // antithetic rngs hand out paths in pairs, so blocks have to start on an even path
+  if (block_size == 0 || block_size % 2 != 0) throw std::runtime_error("simulate_shard: block size must be even");
+  if (first_path > last_path || last_path > num_paths || first_path % block_size != 0 ||
+      (last_path % block_size != 0 && last_path != num_paths))
+    throw std::runtime_error("simulate_shard: shard boundaries must fall on accumulation blocks");
+
+  ShardSnapshot snapshot;
+  snapshot.num_paths = num_paths;
+  snapshot.first_path = first_path;
+  snapshot.last_path = last_path;
+  snapshot.block_size = block_size;
+  snapshot.number_of_payoffs = instrument.number_of_payoffs();
+  snapshot.key = shard_detail::run_key(instrument, model, rng);
+
+  const size_t number_of_blocks = snapshot.number_of_blocks();
+  const size_t m = snapshot.number_of_payoffs;
+  snapshot.sums.assign(number_of_blocks * m, 0.0);
+  snapshot.sums_of_squares.assign(number_of_blocks * m, 0.0);
+
+  auto cmodel = model.clone();
+  cmodel->allocate(instrument.timeline(), instrument.samples_needed());
+  cmodel->initialize(instrument.timeline(), instrument.samples_needed());
+
+  ThreadPool *pool = ThreadPool::get_instance();
+  pool->start();
+
+  // same per thread scratch and absolute rng positioning as parallel_monte_carlo_simulation
+  struct ThreadScratch {
+    std::vector<double> gaussian_vector;
+    std::vector<Scenario<double>> paths;
+    std::vector<std::vector<double>> payoffs;
+    std::unique_ptr<RNG> generator;
+    size_t rng_position{0};
+  };
+  std::vector<std::unique_ptr<ThreadScratch>> scratch(pool->number_of_threads() + 1);
+
+  auto task = [&](const size_t b) {
+    const size_t block_first = first_path + b * block_size;
+    const size_t block_last = std::min(last_path, block_first + block_size);
+
+    auto &mine = scratch[pool->thread_number()];
+    if (!mine) {
+      mine = std::make_unique<ThreadScratch>();
+      mine->gaussian_vector.resize(cmodel->simulation_dimension());
+      mine->paths.resize(path_block_size);
+      for (auto &path : mine->paths) {
+        allocate_path(instrument.samples_needed(), path);
+        initialize_path(path);
+      }
+      mine->payoffs.assign(path_block_size, std::vector<double>(m));
+      mine->generator = rng.clone();
+      mine->generator->initialize(cmodel->simulation_dimension());
+    }
+    mine->generator->jump_ahead(block_first - mine->rng_position);
+
+    double *sum = snapshot.sums.data() + b * m;
+    double *sum_of_squares = snapshot.sums_of_squares.data() + b * m;
+    for (size_t first = block_first; first < block_last; first += path_block_size) {
+      const size_t count = std::min(path_block_size, block_last - first);
+      for (size_t i = 0; i < count; ++i) {
+        mine->generator->get_gaussians(mine->gaussian_vector);
+        cmodel->generate_path(mine->gaussian_vector, mine->paths[i]);
+      }
+      instrument.block_payoffs(mine->paths, count, mine->payoffs.data());
+      for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < m; ++j) {
+          sum[j] += mine->payoffs[i][j];
+          sum_of_squares[j] += mine->payoffs[i][j] * mine->payoffs[i][j];
+        }
+      }
+    }
+    mine->rng_position = block_last;
+  };
+
+  TaskLatch done;
+  pool->spawn_bulk(number_of_blocks, task, done);
+  pool->wait(done);
+  return snapshot;
+}
+
+inline void write_shard_snapshot(const std::string &filename, const ShardSnapshot &snapshot) {
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  if (!out) throw std::runtime_error("write_shard_snapshot: cannot open " + filename);
+
+  shard_detail::Header header{};
+  std::memcpy(header.magic, shard_snapshot_magic, sizeof(header.magic));
+  header.version = shard_snapshot_version;
+  header.num_paths = snapshot.num_paths;
+  header.first_path = snapshot.first_path;
+  header.last_path = snapshot.last_path;
+  header.block_size = snapshot.block_size;
+  header.number_of_payoffs = snapshot.number_of_payoffs;
+  header.key_size = snapshot.key.size();
+
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(snapshot.key.data(), snapshot.key.size());
+  for (size_t b = 0; b < snapshot.number_of_blocks(); ++b) {
+    const size_t m = snapshot.number_of_payoffs;
+    out.write(reinterpret_cast<const char *>(snapshot.sums.data() + b * m), m * sizeof(double));
+    out.write(reinterpret_cast<const char *>(snapshot.sums_of_squares.data() + b * m), m * sizeof(double));
+  }
+  if (!out) throw std::runtime_error("write_shard_snapshot: failed writing " + filename);
+}
+
+inline ShardSnapshot read_shard_snapshot(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary | std::ios::ate);
+  if (!in) throw std::runtime_error("read_shard_snapshot: cannot open " + filename);
+  const auto file_size = static_cast<std::uint64_t>(in.tellg());
+  in.seekg(0);
+
+  shard_detail::Header header{};
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || std::memcmp(header.magic, shard_snapshot_magic, sizeof(header.magic)) != 0)
+    throw std::runtime_error("read_shard_snapshot: " + filename + " is not a shard snapshot");
+  if (header.version != shard_snapshot_version)
+    throw std::runtime_error("read_shard_snapshot: unsupported version in " + filename);
+  if (header.block_size == 0 || header.first_path > header.last_path || header.last_path > header.num_paths)
+    throw std::runtime_error("read_shard_snapshot: corrupt header in " + filename);
+
+  // the key and the blocks have to fit in what is left of the file before anything gets allocated, every
+  // comparison divides the room left rather than multiplying header fields so a corrupt header can't overflow
+  const std::uint64_t room = file_size - std::min<std::uint64_t>(file_size, sizeof(header));
+  if (header.key_size > room) throw std::runtime_error("read_shard_snapshot: " + filename + " is truncated");
+  const std::uint64_t block_room = room - header.key_size;
+  const std::uint64_t block_bytes_per_payoff = 2 * sizeof(double);
+  if (header.number_of_payoffs > block_room / block_bytes_per_payoff)
+    throw std::runtime_error("read_shard_snapshot: " + filename + " is truncated");
+
+  ShardSnapshot snapshot;
+  snapshot.num_paths = header.num_paths;
+  snapshot.first_path = header.first_path;
+  snapshot.last_path = header.last_path;
+  snapshot.block_size = header.block_size;
+  snapshot.number_of_payoffs = header.number_of_payoffs;
+  if (snapshot.number_of_payoffs != 0 &&
+      snapshot.number_of_blocks() > block_room / (block_bytes_per_payoff * snapshot.number_of_payoffs))
+    throw std::runtime_error("read_shard_snapshot: " + filename + " is truncated");
+  snapshot.key.resize(header.key_size);
+  in.read(snapshot.key.data(), snapshot.key.size());
+
+  const size_t m = snapshot.number_of_payoffs;
+  snapshot.sums.resize(snapshot.number_of_blocks() * m);
+  snapshot.sums_of_squares.resize(snapshot.number_of_blocks() * m);
+  for (size_t b = 0; b < snapshot.number_of_blocks(); ++b) {
+    in.read(reinterpret_cast<char *>(snapshot.sums.data() + b * m), m * sizeof(double));
+    in.read(reinterpret_cast<char *>(snapshot.sums_of_squares.data() + b * m), m * sizeof(double));
+  }
+  if (!in) throw std::runtime_error("read_shard_snapshot: " + filename + " is truncated");
+  return snapshot;
+}
+
+// Combines the snapshots of one run into its estimate. The shards may come in any order but must be of the same
+// run and cover [0, num_paths) exactly once, the blocks are then summed in path order.
+inline PricingEstimate merge_shard_snapshots(std::vector<ShardSnapshot> shards) {
+  if (shards.empty()) throw std::runtime_error("merge_shard_snapshots: no shards");
+  std::sort(shards.begin(), shards.end(),
+            [](const ShardSnapshot &a, const ShardSnapshot &b) { return a.first_path < b.first_path; });
+
+  const auto &reference = shards.front();
+  const size_t m = reference.number_of_payoffs;
+  size_t covered = 0;
+  for (const auto &shard : shards) {
+    if (shard.key != reference.key || shard.num_paths != reference.num_paths ||
+        shard.block_size != reference.block_size || shard.number_of_payoffs != m)
+      throw std::runtime_error("merge_shard_snapshots: shards come from different runs");
+    if (shard.first_path != covered)
+      throw std::runtime_error("merge_shard_snapshots: shards overlap or leave a gap at path " + std::to_string(covered));
+    covered = shard.last_path;
+  }
+  if (covered != reference.num_paths) throw std::runtime_error("merge_shard_snapshots: shards stop short of the run");
+
+  std::vector<double> sum(m, 0.0), sum_of_squares(m, 0.0);
+  for (const auto &shard : shards) {
+    for (size_t b = 0; b < shard.number_of_blocks(); ++b) {
+      for (size_t j = 0; j < m; ++j) {
+        sum[j] += shard.sums[b * m + j];
+        sum_of_squares[j] += shard.sums_of_squares[b * m + j];
+      }
+    }
+  }
+
+  PricingEstimate estimate;
+  pricing_scheduler_detail::estimate_from_sums(reference.num_paths, sum, sum_of_squares, estimate);
+  return estimate;
+}
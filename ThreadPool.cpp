@@ -1,5 +1,93 @@
 #include "ThreadPool.h"
+#include <fstream>
+#include <sstream>
+#include <string>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 ThreadPool ThreadPool::instance_;
 
-thread_local size_t ThreadPool::thread_serial_number = 0;
\ No newline at end of file
+thread_local size_t ThreadPool::thread_serial_number = 0;
+
+namespace {
+
+// parses the kernels cpu list format, e.g. "0-3,8-11"
+std::vector<unsigned> parse_cpu_list(const std::string& list){
+    std::vector<unsigned> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while(std::getline(ss, range, ',')){
+        if(range.empty() || range == "\n") continue;
+        const auto dash = range.find('-');
+        const unsigned first = std::stoul(range.substr(0, dash));
+        const unsigned last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+        for(unsigned cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool cpu_allowed(const unsigned cpu){
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) != 0) return true;
+    return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+#else
+    return true;
+#endif
+}
+
+}
+
+CpuTopology CpuTopology::detect(){
+    CpuTopology topology;
+    for(unsigned node = 0; ; ++node){
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if(!in) break;
+        std::string list;
+        std::getline(in, list);
+
+        std::vector<unsigned> cpus;
+        for(const auto cpu : parse_cpu_list(list)) if(cpu_allowed(cpu)) cpus.push_back(cpu);
+        if(!cpus.empty()) topology.nodes.push_back(std::move(cpus));
+    }
+
+    if(topology.nodes.empty()){
+        std::vector<unsigned> cpus;
+        const unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for(unsigned cpu = 0; cpu < n; ++cpu) if(cpu_allowed(cpu)) cpus.push_back(cpu);
+        topology.nodes.push_back(std::move(cpus));
+    }
+    return topology;
+}
+
+size_t CpuTopology::number_of_cpus() const {
+    size_t n = 0;
+    for(const auto& node : nodes) n += node.size();
+    return n;
+}
+
+size_t CpuTopology::node_of_cpu(const unsigned cpu) const {
+    for(size_t i = 0; i < nodes.size(); ++i)
+        if(std::find(nodes[i].begin(), nodes[i].end(), cpu) != nodes[i].end()) return i;
+    return 0;
+}
+
+void ThreadPool::pin_current_thread(const unsigned cpu){
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+int ThreadPool::current_cpu(){
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
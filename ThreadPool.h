@@ -1,6 +1,12 @@
 #pragma once
+#include <cstddef>
 #include <functional>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
@@ -9,42 +15,234 @@
 
 using namespace std::chrono_literals;
 
-// This is a thread safe queue that will be the threadpools SPMC queue.
-template <typename T>
-class ThreadSafeQueue{
-    std::queue<T> queue_;
+// A type erased task that stores its callable inline instead of on the heap. Everything we submit to the pool
+// is a lambda capturing a handful of references and indices, so a fixed 64 bytes of storage is plenty, and
+// anything bigger is a compile error rather than a silent allocation.
+class InlineTask {
+public:
+    static constexpr size_t capacity = 64;
+
+private:
+    alignas(std::max_align_t) unsigned char storage_[capacity];
+    void (*invoke_)(void*) = nullptr;
+    // move constructs the callable into the destination storage and destroys the source
+    void (*relocate_)(void*, void*) = nullptr;
+    void (*destroy_)(void*) = nullptr;
+
+    void reset() {
+        if(destroy_) destroy_(storage_);
+        invoke_ = nullptr;
+        relocate_ = nullptr;
+        destroy_ = nullptr;
+    }
+
+    void take(InlineTask& rhs) {
+        if(rhs.invoke_){
+            rhs.relocate_(rhs.storage_, storage_);
+            invoke_ = rhs.invoke_;
+            relocate_ = rhs.relocate_;
+            destroy_ = rhs.destroy_;
+            rhs.invoke_ = nullptr;
+            rhs.relocate_ = nullptr;
+            rhs.destroy_ = nullptr;
+        }
+    }
+
+public:
+    InlineTask() = default;
+
+    template <typename F, typename Fn = std::decay_t<F>,
+              typename = std::enable_if_t<!std::is_same_v<Fn, InlineTask>>>
+    InlineTask(F&& f) {
+        static_assert(sizeof(Fn) <= capacity, "task captures too much to be stored inline");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "task is over aligned");
+        new (storage_) Fn(std::forward<F>(f));
+        invoke_ = [](void* p){ (*static_cast<Fn*>(p))(); };
+        relocate_ = [](void* from, void* to){
+            new (to) Fn(std::move(*static_cast<Fn*>(from)));
+            static_cast<Fn*>(from)->~Fn();
+        };
+        destroy_ = [](void* p){ static_cast<Fn*>(p)->~Fn(); };
+    }
+
+    InlineTask(InlineTask&& rhs) { take(rhs); }
+
+    InlineTask& operator=(InlineTask&& rhs) {
+        if(this != &rhs){
+            reset();
+            take(rhs);
+        }
+        return *this;
+    }
+
+    InlineTask(const InlineTask& rhs) = delete;
+    InlineTask& operator=(const InlineTask& rhs) = delete;
+
+    ~InlineTask() { reset(); }
+
+    explicit operator bool() const { return invoke_ != nullptr; }
+
+    void operator()() { invoke_(storage_); }
+};
+
+// A countdown used to join a group of tasks, instead of one future (and one shared state allocation) per task.
+// The submitting thread adds the number of tasks it is about to spawn, and each task counts down when it is done.
+class TaskLatch {
+    std::atomic<size_t> count_;
+
+    // The waiter is free to destroy the latch as soon as it sees the count reach zero, which can be before the
+    // final count_down has returned. So the wake up can't go through the latch itself (notifying count_ would),
+    // instead every latch shares one mutex and condition variable that outlive them all.
+    static std::mutex& wake_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::condition_variable& wake_cv() {
+        static std::condition_variable cv;
+        return cv;
+    }
+
+public:
+    explicit TaskLatch(const size_t count = 0): count_(count) {}
+
+    TaskLatch(const TaskLatch& rhs) = delete;
+    TaskLatch& operator=(const TaskLatch& rhs) = delete;
+
+    void add(const size_t n) { count_.fetch_add(n, std::memory_order_relaxed); }
+
+    // only the final count down wakes the waiters, the waiters re-check their own count whenever they wake.
+    // Nothing of the latch is touched after the decrement that releases them.
+    void count_down(const size_t n = 1) {
+        if(count_.fetch_sub(n, std::memory_order_acq_rel) == n){
+            std::lock_guard<std::mutex> lk(wake_mutex());
+            wake_cv().notify_all();
+        }
+    }
+
+    bool ready() const { return count_.load(std::memory_order_acquire) == 0; }
+
+    void wait() const {
+        std::unique_lock<std::mutex> lk(wake_mutex());
+        while(count_.load(std::memory_order_acquire) != 0) wake_cv().wait(lk);
+    }
+};
+
+// This is the threadpools SPMC queue. Tasks live in intrusive nodes drawn from the queue's own free list, which
+// grows a slab at a time and never gives memory back, so once the pool has warmed up pushing and popping
+// tasks does not touch the heap at all.
+class TaskQueue{
+    struct Node {
+        InlineTask task;
+        // what the task belongs to, e.g. the latch of a spawn_bulk, so its waiter can pick out its own tasks
+        const void* owner{nullptr};
+        Node* next{nullptr};
+    };
+    static constexpr size_t slab_size = 256;
+
+    Node* head_{nullptr};
+    Node* tail_{nullptr};
+    Node* free_{nullptr};
+    std::vector<std::unique_ptr<Node[]>> slabs_;
+
     mutable std::mutex mutex_;
     std::condition_variable cond_var_;
     bool interrupt_{false};
 
+    // these must be called with the lock held
+    Node* acquire_node() {
+        if(!free_){
+            slabs_.push_back(std::make_unique<Node[]>(slab_size));
+            Node* slab = slabs_.back().get();
+            for(size_t i = 0; i < slab_size; ++i){
+                slab[i].next = free_;
+                free_ = &slab[i];
+            }
+        }
+        Node* node = free_;
+        free_ = node->next;
+        node->next = nullptr;
+        return node;
+    }
+
+    void link(Node* node) {
+        if(tail_) tail_->next = node;
+        else head_ = node;
+        tail_ = node;
+    }
+
+    // unlinks node, which follows prev (or is the head when prev is null)
+    void unlink(Node* prev, Node* node, InlineTask& t) {
+        if(prev) prev->next = node->next;
+        else head_ = node->next;
+        if(tail_ == node) tail_ = prev;
+        t = std::move(node->task);
+        node->owner = nullptr;
+        node->next = free_;
+        free_ = node;
+    }
+
+    void unlink_front(InlineTask& t) { unlink(nullptr, head_, t); }
+
 public:
 
     bool empty() const {
         std::lock_guard<std::mutex> lk(mutex_);
-        return queue_.empty();
+        return head_ == nullptr;
     }
 
-    void push(T t) {
-        std::lock_guard<std::mutex> lk(mutex_);
-        queue_.push(std::move(t));
+    void push(InlineTask t) {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            Node* node = acquire_node();
+            node->task = std::move(t);
+            link(node);
+        }
         cond_var_.notify_one();
     }
 
-    bool try_pop(T& t){
-        std::lock_guard<std::mutex> lk(mutex_);
-        if(queue_.empty()) return false;
+    // pushes make(0), ..., make(n-1) under a single acquisition of the lock and wakes everybody once
+    template <typename Make>
+    void push_bulk(const size_t n, Make make, const void* owner = nullptr) {
+        if(n == 0) return;
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            for(size_t i = 0; i < n; ++i){
+                Node* node = acquire_node();
+                node->task = make(i);
+                node->owner = owner;
+                link(node);
+            }
+        }
+        cond_var_.notify_all();
+    }
 
-        // need to use moves because copy assignment is deleted for packaged_tasks
-        t = std::move(queue_.front());
-        queue_.pop();
+    bool try_pop(InlineTask& t){
+        std::lock_guard<std::mutex> lk(mutex_);
+        if(!head_) return false;
+        unlink_front(t);
         return true;
     }
 
-    void pop(T& t) {
+    // pops the oldest task pushed for owner, skipping over everybody elses
+    bool try_pop_owned(InlineTask& t, const void* owner){
+        std::lock_guard<std::mutex> lk(mutex_);
+        Node* prev = nullptr;
+        for(Node* node = head_; node; prev = node, node = node->next){
+            if(node->owner == owner){
+                unlink(prev, node, t);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // blocks until there is a task or the queue is interrupted, returns false in the latter case
+    bool pop(InlineTask& t) {
         std::unique_lock<std::mutex> lk(mutex_);
-        while(!interrupt_ && queue_.empty()) cond_var_.wait(lk);
-        t = std::move(queue_.front());
-        queue_.pop();
+        while(!interrupt_ && !head_) cond_var_.wait(lk);
+        if(!head_) return false;
+        unlink_front(t);
+        return true;
     }
 
     void interrupt() {
@@ -57,15 +255,33 @@ public:
     }
 
     void reset_interrupt() {
+        std::lock_guard<std::mutex> lk(mutex_);
         interrupt_ = false;
     }
 
     void clear() {
-        std::queue<T> empty;
-        std::swap(empty, queue_);
+        std::lock_guard<std::mutex> lk(mutex_);
+        InlineTask discarded;
+        while(head_) unlink_front(discarded);
     }
 };
 
+// The cpus of the machine grouped by NUMA node, as reported by the kernel and restricted to the cpus this process
+// is allowed to run on. Machines (or kernels) without NUMA information show up as a single node.
+struct CpuTopology {
+    std::vector<std::vector<unsigned>> nodes;
+
+    static CpuTopology detect();
+
+    size_t number_of_nodes() const {return nodes.size();}
+    size_t number_of_cpus() const;
+    size_t node_of_cpu(const unsigned cpu) const;
+};
+
+// How workers are pinned to cpus. compact fills one node before moving on to the next, which keeps a small pool
+// on a single socket, scatter deals workers round robin across the nodes to use every sockets memory bandwidth.
+enum class ThreadPlacement { none, compact, scatter };
+
 // The parallel algorithm will use a threadpool as our executor.
 class ThreadPool{
     //singleton pattern
@@ -73,18 +289,49 @@ class ThreadPool{
     ThreadPool(): active_(false), interrupt_(false) {}
 
     bool active_;
-    bool interrupt_;
+    std::atomic<bool> interrupt_;
 
-    ThreadSafeQueue<std::packaged_task<bool(void)>> queue_;
+    TaskQueue queue_;
     std::vector<std::thread> threads_;
 
+    // indexed by thread number, entry 0 is the thread that called start(). Unpinned threads have no cpu
+    CpuTopology topology_;
+    std::vector<int> thread_cpus_;
+    std::vector<size_t> thread_nodes_;
+
+    static constexpr int unpinned = -1;
+
+    // defined in ThreadPool.cpp, these are the only platform specific bits of the pool
+    static void pin_current_thread(const unsigned cpu);
+    static int current_cpu();
+
+    std::vector<int> place_threads(const size_t num_threads, const ThreadPlacement placement) const {
+        std::vector<int> cpus(num_threads, unpinned);
+        if(placement == ThreadPlacement::none || topology_.number_of_cpus() == 0) return cpus;
+
+        std::vector<unsigned> order;
+        if(placement == ThreadPlacement::compact){
+            for(const auto& node : topology_.nodes) order.insert(order.end(), node.begin(), node.end());
+        }
+        else{
+            size_t widest = 0;
+            for(const auto& node : topology_.nodes) widest = std::max(widest, node.size());
+            for(size_t i = 0; i < widest; ++i)
+                for(const auto& node : topology_.nodes)
+                    if(i < node.size()) order.push_back(node[i]);
+        }
+
+        for(size_t i = 0; i < num_threads; ++i) cpus[i] = static_cast<int>(order[i % order.size()]);
+        return cpus;
+    }
 
     void thread_function(const size_t n){
         thread_serial_number = n;
-        std::packaged_task<bool(void)> task;
+        // pin before doing anything else so that everything this worker touches from here on is local to its node
+        if(thread_cpus_[n] != unpinned) pin_current_thread(static_cast<unsigned>(thread_cpus_[n]));
+        InlineTask task;
         while(!interrupt_){
-            queue_.pop(task);
-            if(!interrupt_) task();
+            if(queue_.pop(task) && !interrupt_) task();
         }
     }
 
@@ -98,10 +345,24 @@ public:
     ThreadPool& operator=(const ThreadPool& rhs) = delete;
     ThreadPool& operator=(ThreadPool&& rhs) = delete;
 
-    void start(const size_t num_threads = std::thread::hardware_concurrency() - 1){
+    void start(const size_t num_threads = std::thread::hardware_concurrency() - 1,
+               const ThreadPlacement placement = ThreadPlacement::none){
         if(!active_){
+            topology_ = CpuTopology::detect();
+
+            // the calling thread is never pinned, we just record where it happens to be running
+            const int main_cpu = current_cpu();
+            thread_cpus_ = place_threads(num_threads, placement);
+            thread_cpus_.insert(thread_cpus_.begin(), unpinned);
+            thread_nodes_.resize(num_threads + 1);
+            thread_nodes_[0] = main_cpu < 0 ? 0 : topology_.node_of_cpu(static_cast<unsigned>(main_cpu));
+            for(size_t i = 1; i <= num_threads; ++i){
+                thread_nodes_[i] = thread_cpus_[i] == unpinned ? thread_nodes_[0]
+                                                               : topology_.node_of_cpu(static_cast<unsigned>(thread_cpus_[i]));
+            }
+
             threads_.reserve(num_threads);
-            for(auto i = 0; i < num_threads; ++i){
+            for(size_t i = 0; i < num_threads; ++i){
                 threads_.push_back(std::thread(&ThreadPool::thread_function, this, i + 1));
             }
             active_ = true;
@@ -116,6 +377,20 @@ public:
 
     static size_t thread_number() {return thread_serial_number;}
 
+    // the topology the pool was started on, and where each thread lives in it, so engines can shard work per socket.
+    // Unpinned workers are reported on the node of the thread that started the pool.
+    const CpuTopology& topology() const {return topology_;}
+
+    size_t node_of_thread(const size_t thread_num) const {return thread_nodes_[thread_num];}
+
+    int cpu_of_thread(const size_t thread_num) const {return thread_cpus_[thread_num];}
+
+    std::vector<size_t> threads_on_node(const size_t node) const {
+        std::vector<size_t> threads;
+        for(size_t i = 0; i < thread_nodes_.size(); ++i) if(thread_nodes_[i] == node) threads.push_back(i);
+        return threads;
+    }
+
     // stop() is called from the destructor, so just cleans up the threadpool and queue on program exit.
     void stop(){
         if(active_){
@@ -131,19 +406,44 @@ public:
         }
     }
 
-    // takes a lambda f, converts it into a promise which is pushed onto the queue, and returns a future for that promise
+    // takes a lambda f, converts it into a promise which is pushed onto the queue, and returns a future for that promise.
+    // the promise allocates its shared state, prefer spawn_bulk for anything on a hot path
     template <typename F>
     std::future<bool> spawn_task(F f){
         std::packaged_task<bool(void)> prom(std::move(f));
         std::future<bool> future_ = prom.get_future();
-        queue_.push(std::move(prom));
+        queue_.push(InlineTask(std::move(prom)));
         return future_;
     }
 
+    // runs f(0), ..., f(n-1) on the pool and counts each one down on latch once it returns. All n tasks are
+    // enqueued in one go, and each one only carries a pointer to f, its index and a pointer to the latch, so
+    // nothing is allocated. f and latch must outlive the tasks, i.e. the caller has to wait on the latch.
+    template <typename F>
+    void spawn_bulk(const size_t n, const F& f, TaskLatch& latch){
+        latch.add(n);
+        queue_.push_bulk(n, [&f, &latch](const size_t i){
+            return InlineTask([fn = &f, i, l = &latch](){
+                (*fn)(i);
+                l->count_down();
+            });
+        }, &latch);
+    }
+
+    // once the calling thread is done populating the queue it works on its own tasks while it waits on the latch.
+    // Only its own: every thread outside the pool is thread 0, and the engines hand out per thread scratch by
+    // thread number, so running another callers task here would share its thread 0 scratch with that caller.
+    void wait(const TaskLatch& latch){
+        InlineTask task;
+        while(!latch.ready()){
+            if(queue_.try_pop_owned(task, &latch)) task();
+            else latch.wait();
+        }
+    }
 
-    // once the main thread is done populating the queue it will steal some work. This feature is currently not working
+    // once the main thread is done populating the queue it will steal some work while it waits on fut
     bool active_wait(const std::future<bool>& fut){
-        std::packaged_task<bool(void)> task;
+        InlineTask task;
         bool res{false};
 
         // doing this wait on fut prevents blocking
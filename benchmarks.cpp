@@ -1,6 +1,13 @@
 #include <benchmark/benchmark.h>
 #include "MCLib.h"
 #include "RNGs.h"
+#include "PricingServer.h"
+#include "PricingClient.h"
+#include "ScriptedInstrument.h"
+#include "Calibration.h"
+#include "Instruments.h"
+#include "FinancialModels.h"
+#include <filesystem>
 
 
 
@@ -18,9 +25,171 @@ BENCHMARK(BM_Mersenne);
 static void BM_PCG(benchmark::State& state) {
   PCGRNG rng;
   std::vector<double> gaussian_vector(100000);
+  rng.initialize(gaussian_vector.size());
   for (auto _ : state)
     rng.get_gaussians(gaussian_vector);
 }
 BENCHMARK(BM_PCG);
 
+// task submission overhead of the pool, one future per task against one latch for the whole range
+static void BM_SpawnTask(benchmark::State& state) {
+  ThreadPool* pool = ThreadPool::get_instance();
+  pool->start();
+  std::vector<std::future<bool>> futures(state.range(0));
+  for (auto _ : state) {
+    for (auto& fut : futures) fut = pool->spawn_task([]() { return true; });
+    for (auto& fut : futures) pool->active_wait(fut);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SpawnTask)->Arg(1024);
+
+static void BM_SpawnBulk(benchmark::State& state) {
+  ThreadPool* pool = ThreadPool::get_instance();
+  pool->start();
+  auto task = [](const size_t i) { benchmark::DoNotOptimize(i); };
+  for (auto _ : state) {
+    TaskLatch done;
+    pool->spawn_bulk(state.range(0), task, done);
+    pool->wait(done);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SpawnBulk)->Arg(1024);
+
+// payoff evaluation only, over one block of simulated paths: the hand written EuropeanCall against the same
+// call written as a script
+static void run_block_payoffs(benchmark::State& state, const Instrument<double>& instrument) {
+  BlackScholesModel<double> model{100.0, 0.2};
+  MersenneTwistRNG rng;
+  model.allocate(instrument.timeline(), instrument.samples_needed());
+  model.initialize(instrument.timeline(), instrument.samples_needed());
+  rng.initialize(model.simulation_dimension());
+
+  std::vector<double> gaussians(model.simulation_dimension());
+  std::vector<Scenario<double>> paths(path_block_size);
+  for (auto& path : paths) {
+    allocate_path(instrument.samples_needed(), path);
+    rng.get_gaussians(gaussians);
+    model.generate_path(gaussians, path);
+  }
+
+  std::vector<std::vector<double>> results(path_block_size, std::vector<double>(1));
+  for (auto _ : state) {
+    instrument.block_payoffs(paths, path_block_size, results.data());
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * path_block_size);
+}
+
+static void BM_EuropeanCallPayoffs(benchmark::State& state) {
+  run_block_payoffs(state, EuropeanCall<double>{100.0, 1.0});
+}
+BENCHMARK(BM_EuropeanCallPayoffs);
+
+static void BM_ScriptedCallPayoffs(benchmark::State& state) {
+  run_block_payoffs(state, ScriptedInstrument<double>{"K = 100\non 1.0: pay max(spot - K, 0)"});
+}
+BENCHMARK(BM_ScriptedCallPayoffs);
+
+// whole simulations of a monthly monitored call, rng included, so the merton model pays for its extra draws
+static void run_model_paths(benchmark::State& state, const FinancialModel<double>& model) {
+  ScriptedInstrument<double> monthly{R"(
+    on 0.0833333333: on 0.1666666667: on 0.25: on 0.3333333333: on 0.4166666667: on 0.5:
+    on 0.5833333333: on 0.6666666667: on 0.75: on 0.8333333333: on 0.9166666667:
+    on 1.0: pay max(spot - 100, 0)
+  )"};
+  MersenneTwistRNG rng;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(monte_carlo_simulation(monthly, model, rng, state.range(0)));
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+static void BM_BlackScholesPaths(benchmark::State& state) {
+  run_model_paths(state, BlackScholesModel<double>{100.0, 0.2, 0.02});
+}
+BENCHMARK(BM_BlackScholesPaths)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static void BM_MertonJumpPaths(benchmark::State& state) {
+  run_model_paths(state, MertonJumpModel<double>{100.0, 0.2, 0.02, 0.0, 1.0, -0.1, 0.15});
+}
+BENCHMARK(BM_MertonJumpPaths)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// a full calibration of vol and dividend yield to a 15 quote surface, common random numbers drawn included
+static void BM_Calibration(benchmark::State& state) {
+  MersenneTwistRNG rng;
+  std::vector<CalibrationQuote> quotes;
+  for (const double expiration : {0.5, 1.0, 2.0})
+    for (const double strike : {80.0, 90.0, 100.0, 110.0, 120.0})
+      quotes.push_back({EuropeanCall<double>{strike, expiration}, 0.0});
+
+  CalibrationConfig config;
+  config.num_paths = state.range(0);
+  BlackScholesModel<double> truth{100.0, 0.25, 0.02, 0.03};
+  const auto prices = CalibrationPricer(quotes, truth, rng, config).price({1, 3}, {{0.25, 0.03}})[0];
+  for (size_t q = 0; q < quotes.size(); ++q) quotes[q].price = prices[q];
+
+  BlackScholesModel<double> guess{100.0, 0.15, 0.02, 0.0};
+  size_t iterations = 0;
+  for (auto _ : state)
+    iterations += calibrate(quotes, guess, rng, {{1, 0.01, 2.0}, {3, -0.2, 0.2}}, config).iterations;
+  state.counters["iterations"] = static_cast<double>(iterations) / state.iterations();
+}
+BENCHMARK(BM_Calibration)->Arg(50000)->Unit(benchmark::kMillisecond);
+
+// a daily monitored asian, priced through whole scenarios against streamed samples
+static std::vector<double> daily_dates() {
+  std::vector<double> dates;
+  for (int i = 1; i <= 252; ++i) dates.push_back(i / 252.0);
+  return dates;
+}
+
+static void BM_AsianScenarioEngine(benchmark::State& state) {
+  ArithmeticAsianCall<double> asian{100.0, daily_dates()};
+  BlackScholesModel<double> model{100.0, 0.2, 0.02};
+  MersenneTwistRNG rng;
+  for (auto _ : state) benchmark::DoNotOptimize(monte_carlo_simulation(asian, model, rng, state.range(0)));
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AsianScenarioEngine)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static void BM_AsianStreamingEngine(benchmark::State& state) {
+  ArithmeticAsianCall<double> asian{100.0, daily_dates()};
+  BlackScholesModel<double> model{100.0, 0.2, 0.02};
+  MersenneTwistRNG rng;
+  for (auto _ : state) benchmark::DoNotOptimize(streaming_monte_carlo_simulation(asian, model, rng, state.range(0)));
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AsianStreamingEngine)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// round trip latency of a small pricing against a resident server, client and server share this process but
+// talk over the socket exactly like separate processes would
+static void BM_PricingServerRoundTrip(benchmark::State& state) {
+  const auto socket_path = (std::filesystem::temp_directory_path() / "mclib_pricing_bench.sock").string();
+  PricingServer server(socket_path);
+  std::thread accept_loop([&]() { server.run(); });
+
+  {
+    PricingClient client(socket_path);
+    PricingRequest request;
+    request.num_paths = state.range(0);
+    request.spot = 100.0;
+    request.vol = 0.2;
+    request.strike = 100.0;
+    request.expiration = 1.0;
+
+    double server_microseconds = 0.0;
+    for (auto _ : state) {
+      // a new spot on every request, the way an intraday quote stream looks
+      request.spot = request.spot == 100.0 ? 100.5 : 100.0;
+      server_microseconds += client.price(request).server_microseconds;
+    }
+    state.counters["server_us"] = server_microseconds / state.iterations();
+  }
+
+  server.request_stop();
+  accept_loop.join();
+}
+BENCHMARK(BM_PricingServerRoundTrip)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
 BENCHMARK_MAIN();
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "PricingServer.h"
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+// Resident pricing daemon. Keeps the ThreadPool hot and the models warm, and answers PricingRequests sent by
+// PricingClient over a Unix domain socket.
+//
+//   usage: pricing_server [socket_path] [worker_threads] [max_paths_per_request]
+
+namespace {
+PricingServer *running_server = nullptr;
+
+void handle_signal(int){
+    if(running_server) running_server->request_stop();
+}
+}
+
+int main(int argc, char **argv){
+    const std::string socket_path = argc > 1 ? argv[1] : "/tmp/mclib_pricing.sock";
+    const size_t threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : std::thread::hardware_concurrency() - 1;
+    const size_t max_paths = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : PricingServer::default_max_paths;
+
+    // start the pool before the first request arrives rather than on it
+    ThreadPool::get_instance()->start(threads);
+
+    try{
+        PricingServer server(socket_path, 1024, max_paths);
+        running_server = &server;
+        std::signal(SIGINT, handle_signal);
+        std::signal(SIGTERM, handle_signal);
+
+        std::cout << "pricing_server listening on " << socket_path << " with "
+                  << ThreadPool::get_instance()->number_of_threads() << " workers" << std::endl;
+        server.run();
+        running_server = nullptr;
+    }
+    catch(const std::exception &e){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include "ShardedSimulation.h"
+#include "ScriptedInstrument.h"
+#include "FinancialModels.h"
+#include "RNGs.h"
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs one shard of a simulation, merges shard snapshots, or forks a set of local shards for testing.
+//
+//   usage: shard_tool run <snapshot> <first> <last> [options]
+//          shard_tool merge <snapshot>...
+//          shard_tool launch <shards> <directory> [options]
+//
+//   options: --paths N --block N --threads N --seed N --script FILE
+//            --model black_scholes|merton --spot --vol --rate --div --intensity --jump-mean --jump-vol
+//
+// The trade is a scripted instrument (see ScriptedInstrument.h), an at the money one year call by default. Every
+// shard of a run has to be given the same options, the snapshots remember what they were run with and merge
+// refuses to combine shards of different runs.
+
+namespace {
+
+struct Options {
+  std::map<std::string, std::string> values;
+
+  std::string get(const std::string &name, const std::string &fallback) const {
+    const auto it = values.find(name);
+    return it == values.end() ? fallback : it->second;
+  }
+  double number(const std::string &name, const double fallback) const {
+    return std::stod(get(name, std::to_string(fallback)));
+  }
+  size_t count(const std::string &name, const size_t fallback) const {
+    return std::stoull(get(name, std::to_string(fallback)));
+  }
+};
+
+Options parse_options(int argc, char **argv, int first) {
+  Options options;
+  for (int i = first; i < argc; i += 2) {
+    const std::string name = argv[i];
+    if (name.rfind("--", 0) != 0 || i + 1 >= argc) throw std::runtime_error("bad option " + name);
+    options.values[name.substr(2)] = argv[i + 1];
+  }
+  return options;
+}
+
+struct Run {
+  std::unique_ptr<Instrument<double>> instrument;
+  std::unique_ptr<FinancialModel<double>> model;
+  std::unique_ptr<RNG> rng;
+  size_t num_paths;
+  size_t block_size;
+};
+
+Run make_run(const Options &options) {
+  Run run;
+  std::string source = "on 1.0: pay max(spot - 100, 0)";
+  if (options.values.count("script")) {
+    std::ifstream in(options.get("script", ""));
+    if (!in) throw std::runtime_error("cannot read " + options.get("script", ""));
+    std::stringstream text;
+    text << in.rdbuf();
+    source = text.str();
+  }
+  run.instrument = std::make_unique<ScriptedInstrument<double>>(source);
+
+  const double spot = options.number("spot", 100.0), vol = options.number("vol", 0.2);
+  const double rate = options.number("rate", 0.0), div = options.number("div", 0.0);
+  const std::string model = options.get("model", "black_scholes");
+  if (model == "black_scholes") {
+    run.model = std::make_unique<BlackScholesModel<double>>(spot, vol, rate, div);
+  } else if (model == "merton") {
+    run.model = std::make_unique<MertonJumpModel<double>>(spot, vol, rate, div, options.number("intensity", 0.5),
+                                                          options.number("jump-mean", -0.1),
+                                                          options.number("jump-vol", 0.15));
+  } else {
+    throw std::runtime_error("unknown model " + model);
+  }
+
+  run.rng = std::make_unique<MersenneTwistRNG>(options.count("seed", 42));
+  run.num_paths = options.count("paths", 1000000);
+  run.block_size = options.count("block", 4096);
+  return run;
+}
+
+void run_shard(const Options &options, const std::string &snapshot, const size_t first, const size_t last) {
+  ThreadPool::get_instance()->start(options.count("threads", std::thread::hardware_concurrency() - 1));
+  const auto run = make_run(options);
+  write_shard_snapshot(snapshot, simulate_shard(*run.instrument, *run.model, *run.rng, run.num_paths, first, last,
+                                                run.block_size));
+}
+
+// full precision, so merged runs can be compared bit for bit
+void print(const PricingEstimate &estimate) {
+  std::cout << std::setprecision(std::numeric_limits<double>::max_digits10);
+  std::cout << "paths " << estimate.paths_done << std::endl;
+  for (size_t j = 0; j < estimate.mean.size(); ++j)
+    std::cout << "payoff " << j << " price " << estimate.mean[j] << " standard_error " << estimate.standard_error[j]
+              << std::endl;
+}
+
+// every shard is a forked child running run_shard, the parent never starts its pool so there are no threads
+// around at fork time
+int launch(const Options &options, const size_t shards, const std::string &directory) {
+  const size_t num_paths = options.count("paths", 1000000);
+  const size_t block_size = options.count("block", 4096);
+
+  std::vector<std::string> snapshots;
+  std::vector<pid_t> children;
+  for (size_t s = 0; s < shards; ++s) {
+    snapshots.push_back(directory + "/shard_" + std::to_string(s) + ".snap");
+    const auto [first, last] = shard_range(num_paths, s, shards, block_size);
+    const pid_t pid = ::fork();
+    if (pid < 0) throw std::runtime_error("fork failed");
+    if (pid == 0) {
+      try {
+        run_shard(options, snapshots.back(), first, last);
+      } catch (const std::exception &e) {
+        std::cerr << "shard " << s << ": " << e.what() << std::endl;
+        std::_Exit(1);
+      }
+      std::_Exit(0);
+    }
+    children.push_back(pid);
+  }
+
+  bool failed = false;
+  for (const pid_t pid : children) {
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  if (failed) throw std::runtime_error("a shard failed");
+
+  std::vector<ShardSnapshot> parts;
+  for (const auto &snapshot : snapshots) parts.push_back(read_shard_snapshot(snapshot));
+  print(merge_shard_snapshots(std::move(parts)));
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const std::string mode = argc > 1 ? argv[1] : "";
+  try {
+    if (mode == "run" && argc >= 5) {
+      run_shard(parse_options(argc, argv, 5), argv[2], std::stoull(argv[3]), std::stoull(argv[4]));
+      return 0;
+    }
+    if (mode == "merge" && argc >= 3) {
+      std::vector<ShardSnapshot> parts;
+      for (int i = 2; i < argc; ++i) parts.push_back(read_shard_snapshot(argv[i]));
+      print(merge_shard_snapshots(std::move(parts)));
+      return 0;
+    }
+    if (mode == "launch" && argc >= 4) return launch(parse_options(argc, argv, 4), std::stoull(argv[2]), argv[3]);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cerr << "usage: shard_tool run <snapshot> <first> <last> [options]\n"
+               "       shard_tool merge <snapshot>...\n"
+               "       shard_tool launch <shards> <directory> [options]"
+            << std::endl;
+  return 1;
+}
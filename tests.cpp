@@ -2,8 +2,18 @@
 #include "RNGs.h"
 #include "Instruments.h"
 #include "FinancialModels.h"
+#include "PricingCache.h"
+#include "PathStore.h"
+#include "PricingScheduler.h"
+#include "PricingServer.h"
+#include "PricingClient.h"
+#include "ScriptedInstrument.h"
+#include "ShardedSimulation.h"
+#include "Calibration.h"
 #include <algorithm>
 #include <functional>
+#include <filesystem>
+#include <cstddef>
 
 
 TEST_CASE("MersenneTwist RNG basic operations", "[RNG]") {
@@ -44,6 +54,12 @@ TEST_CASE("MersenneTwist RNG basic operations", "[RNG]") {
   rng3.get_gaussians(gaussian_vector3);
   REQUIRE(gaussian_vector2 == gaussian_vector3);
 
+  // an odd jump lands on the negated half of a pair
+  rng2.jump_ahead(3);
+  for(int i = 0; i < 3; ++i) rng3.get_gaussians(gaussian_vector3);
+  rng2.get_gaussians(gaussian_vector2);
+  rng3.get_gaussians(gaussian_vector3);
+  REQUIRE(gaussian_vector2 == gaussian_vector3);
 }
 
 TEST_CASE("PCG RNG basic operations", "[RNG]"){
@@ -73,14 +89,32 @@ TEST_CASE("PCG RNG basic operations", "[RNG]"){
   rng3.initialize(10);
   std::vector<double> gaussian_vector3(10);
 
-  rng.jump_ahead(1000);
+  rng2.jump_ahead(1000);
   for(int i = 0; i < 1000; ++i) rng3.get_gaussians(gaussian_vector3);
 
-  rng.get_gaussians(gaussian_vector2);
+  rng2.get_gaussians(gaussian_vector2);
   rng3.get_gaussians(gaussian_vector3);
+  REQUIRE(gaussian_vector2 == gaussian_vector3);
 
-  // TODO
-  //REQUIRE(gaussian_vector2 == gaussian_vector3);
+  // odd jumps, from both halves of an antithetic pair
+  for(const size_t steps : {3, 1, 4, 5}){
+    rng2.jump_ahead(steps);
+    for(size_t i = 0; i < steps; ++i) rng3.get_gaussians(gaussian_vector3);
+    rng2.get_gaussians(gaussian_vector2);
+    rng3.get_gaussians(gaussian_vector3);
+    REQUIRE(gaussian_vector2 == gaussian_vector3);
+  }
+
+  // an odd dimension still draws a whole pair for its last gaussian
+  PCGRNG odd, odd_reference;
+  odd.initialize(7);
+  odd_reference.initialize(7);
+  std::vector<double> odd_vector(7), odd_reference_vector(7);
+  odd.jump_ahead(9);
+  for(int i = 0; i < 9; ++i) odd_reference.get_gaussians(odd_reference_vector);
+  odd.get_gaussians(odd_vector);
+  odd_reference.get_gaussians(odd_reference_vector);
+  REQUIRE(odd_vector == odd_reference_vector);
 }
 
 TEST_CASE("European Call price", "[Instrument]"){
@@ -132,6 +166,90 @@ TEST_CASE("Black Scholes Model", "[FinancialModel]"){
   REQUIRE(std::abs(result[0][0] - 20.0) <= 0.5);
 }
 
+TEST_CASE("Black Scholes Model only recomputes what moved", "[FinancialModel]"){
+  EuropeanCall<double> call{100.0, 1.0};
+  EuropeanCall<double> same_shape{100.0, 1.0};
+  std::vector<double> fake_gauss(1, 1.0);
+
+  BlackScholesModel<double> model{100.0, 0.2, 0.01, 0.0};
+  model.allocate(call.timeline(), call.samples_needed());
+  model.initialize(call.timeline(), call.samples_needed());
+
+  // bump every parameter through the public pointers the way the greeks code does, and reprice a trade of the same shape
+  auto& params = model.parameters();
+  *params[0] = 105.0;
+  *params[1] = 0.25;
+  *params[2] = 0.03;
+  *params[3] = 0.01;
+  model.allocate(same_shape.timeline(), same_shape.samples_needed());
+  model.initialize(same_shape.timeline(), same_shape.samples_needed());
+
+  BlackScholesModel<double> fresh{105.0, 0.25, 0.03, 0.01};
+  fresh.allocate(call.timeline(), call.samples_needed());
+  fresh.initialize(call.timeline(), call.samples_needed());
+
+  Scenario<double> path, fresh_path;
+  allocate_path(call.samples_needed(), path);
+  allocate_path(call.samples_needed(), fresh_path);
+  model.generate_path(fake_gauss, path);
+  fresh.generate_path(fake_gauss, fresh_path);
+
+  REQUIRE(path[0].numeraire == fresh_path[0].numeraire);
+  REQUIRE(path[0].forwards == fresh_path[0].forwards);
+  REQUIRE(path[0].discounts == fresh_path[0].discounts);
+
+  // a spot only move leaves every table alone but still moves the path
+  *params[0] = 110.0;
+  model.initialize(call.timeline(), call.samples_needed());
+  model.generate_path(fake_gauss, path);
+  REQUIRE(std::abs(path[0].forwards[0] - fresh_path[0].forwards[0] * 110.0 / 105.0) <= 1e-12);
+}
+
+TEST_CASE("Model tables are cached across clones and parameter moves", "[FinancialModel]"){
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng;
+  BlackScholesModel<double> model{100.0, 0.2, 0.01, 0.0};
+  const auto& cache = model.table_cache();
+
+  // a cold model builds all five of its tables once, the engines clone it and find them warm
+  const auto first = parallel_monte_carlo_simulation(call, model, rng, 2000);
+  REQUIRE(cache.misses() == 1);
+  REQUIRE(cache.recomputes() == 5);
+  REQUIRE(monte_carlo_simulation(call, model, rng, 2000) == first);
+  REQUIRE(parallel_monte_carlo_simulation(call, model, rng, 2000) == first);
+  REQUIRE(cache.misses() == 1);
+  REQUIRE(cache.recomputes() == 5);
+
+  // spot is not in any table
+  auto& params = model.parameters();
+  *params[0] = 105.0;
+  monte_carlo_simulation(call, model, rng, 10);
+  REQUIRE(cache.misses() == 1);
+
+  // a vol bump only rebuilds the drifts and stds, and bumping back finds the original tables
+  *params[1] = 0.21;
+  monte_carlo_simulation(call, model, rng, 10);
+  REQUIRE(cache.misses() == 2);
+  REQUIRE(cache.recomputes() == 7);
+  *params[0] = 100.0;
+  *params[1] = 0.2;
+  REQUIRE(monte_carlo_simulation(call, model, rng, 2000) == first);
+  REQUIRE(cache.misses() == 2);
+
+  // a div bump rebuilds the drifts and forwards, the numeraires and discounts stay
+  *params[3] = 0.02;
+  monte_carlo_simulation(call, model, rng, 10);
+  REQUIRE(cache.recomputes() == 9);
+
+  // a trade of another shape gets tables of its own next to the first ones
+  EuropeanCall<double> longer{100.0, 2.0};
+  *params[3] = 0.0;
+  monte_carlo_simulation(longer, model, rng, 10);
+  REQUIRE(cache.recomputes() == 14);
+  REQUIRE(monte_carlo_simulation(call, model, rng, 2000) == first);
+  REQUIRE(cache.recomputes() == 14);
+}
+
 TEST_CASE("Simulation works!", "[Simulation]"){
   BlackScholesModel<double> model{100.0, 0.2};
   EuropeanCall<double> call{100.0, 1.0};
@@ -152,4 +270,682 @@ TEST_CASE("Parallel Simulation Works!", "[Simulation]"){
   auto price = std::accumulate(result.begin(), result.end(), 0.0l,
                [](auto acc, auto v){return acc + v[0];}) / 100000;
   REQUIRE(std::abs(price - 7.97) <= 0.1);
-}
\ No newline at end of file
+
+  // every path gets the sequential engine's gaussians, whichever thread ran it, for both rngs
+  REQUIRE(result == monte_carlo_simulation(call, model, rng, 100000));
+  REQUIRE(parallel_monte_carlo_simulation(call, model, rng, 100000) == result);
+  MersenneTwistRNG mt;
+  REQUIRE(parallel_monte_carlo_simulation(call, model, mt, 20000) == monte_carlo_simulation(call, model, mt, 20000));
+}
+
+TEST_CASE("Pricing cache hits, misses and evictions", "[PricingCache]"){
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng{7};
+
+  PricingCache cache(1 << 20);
+  auto first = cache.price(call, model, rng, 1000);
+  auto second = cache.price(call, model, rng, 1000);
+
+  // the second pricing is served from the cache and matches a fresh simulation exactly
+  REQUIRE(first == second);
+  REQUIRE(*first == monte_carlo_simulation(call, model, rng, 1000));
+  REQUIRE(cache.stats().hits == 1);
+  REQUIRE(cache.stats().misses == 1);
+
+  // any change to the model, instrument, seed or path count is a different pricing
+  BlackScholesModel<double> bumped{100.0, 0.21};
+  EuropeanCall<double> other_strike{101.0, 1.0};
+  MersenneTwistRNG other_seed{8};
+  cache.price(call, bumped, rng, 1000);
+  cache.price(other_strike, model, rng, 1000);
+  cache.price(call, model, other_seed, 1000);
+  cache.price(call, model, rng, 1001);
+  REQUIRE(cache.stats().misses == 5);
+  REQUIRE(cache.stats().entries == 5);
+
+  // a budget that holds roughly one result evicts the least recently used one
+  PricingCache small(40000);
+  small.price(call, model, rng, 1000);
+  small.price(call, bumped, rng, 1000);
+  REQUIRE(small.stats().evictions == 1);
+  REQUIRE(small.stats().entries == 1);
+  REQUIRE(small.stats().bytes <= 40000);
+  small.price(call, bumped, rng, 1000);
+  REQUIRE(small.stats().hits == 1);
+
+  // concurrent callers on the parallel engine, two of them racing on each key, all get the engine's exact result
+  PricingCache shared(1 << 24);
+  const std::vector<double> strikes{90.0, 100.0, 110.0};
+  std::vector<PricingCache::Result> seen(2 * strikes.size());
+  std::vector<std::thread> callers;
+  for(size_t c = 0; c < seen.size(); ++c)
+    callers.emplace_back([&, c](){
+      seen[c] = *shared.price(EuropeanCall<double>{strikes[c % strikes.size()], 1.0}, model, rng, 20000,
+                              PricingEngine::parallel);
+    });
+  for(auto& caller : callers) caller.join();
+  for(size_t c = 0; c < seen.size(); ++c)
+    REQUIRE(seen[c] == parallel_monte_carlo_simulation(EuropeanCall<double>{strikes[c % strikes.size()], 1.0},
+                                                       model, rng, 20000));
+  REQUIRE(shared.stats().entries == strikes.size());
+
+  // a cached parallel pcg pricing is the one every later run would produce, not one arbitrary schedule
+  PCGRNG pcg{7};
+  const auto cached = shared.price(call, model, pcg, 20000, PricingEngine::parallel);
+  REQUIRE(*cached == parallel_monte_carlo_simulation(call, model, pcg, 20000));
+  REQUIRE(*cached == monte_carlo_simulation(call, model, pcg, 20000));
+}
+
+TEST_CASE("Path store replay matches the simulation", "[PathStore]"){
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng;
+  const auto filename = (std::filesystem::temp_directory_path() / "mclib_path_store_test.bin").string();
+
+  // a store with exactly the calls layout replays to exactly what the engine would have computed
+  simulate_to_path_store(filename, call.timeline(), call.samples_needed(), model, rng, 10000, 3000);
+  {
+    PathStore store(filename);
+    REQUIRE(store.number_of_paths() == 10000);
+    REQUIRE(store.timeline() == call.timeline());
+    REQUIRE(store.samples_needed() == call.samples_needed());
+    REQUIRE(replay_path_store(store, call) == monte_carlo_simulation(call, model, rng, 10000));
+  }
+
+  // a richer store can reprice any instrument whose dates and maturities it contains
+  std::vector<double> timeline{0.5, 1.0};
+  std::vector<SampleDef<double>> samples(2);
+  samples[0].numeraire = false;
+  samples[0].forward_maturities = {0.5, 1.0};
+  samples[1].forward_maturities = {1.0};
+  samples[1].discount_maturities = {1.0, 2.0};
+  simulate_to_path_store(filename, timeline, samples, model, rng, 200000);
+  {
+    PathStore store(filename);
+    auto result = replay_path_store(store, call);
+    auto price = std::accumulate(result.begin(), result.end(), 0.0l,
+                 [](auto acc, auto v){return acc + v[0];}) / result.size();
+    REQUIRE(std::abs(price - 7.97) <= 0.1);
+
+    EuropeanCall<double> too_long{100.0, 3.0};
+    REQUIRE_THROWS(replay_path_store(store, too_long));
+  }
+
+  // a path count whose size in bytes wraps around to almost nothing is refused rather than read past the file
+  std::uint64_t wraps = 7;
+  for(int i = 0; i < 5; ++i) wraps *= 2 - 7 * wraps;
+  REQUIRE(wraps * 7 * sizeof(double) == sizeof(double));
+  {
+    std::fstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(offsetof(path_store_detail::Header, number_of_paths));
+    file.write(reinterpret_cast<const char*>(&wraps), sizeof(wraps));
+  }
+  REQUIRE_THROWS(PathStore(filename));
+
+  // a timeline and sample definitions that don't line up are refused before anything is written
+  std::filesystem::remove(filename);
+  REQUIRE_THROWS_AS(simulate_to_path_store(filename, timeline, std::vector<SampleDef<double>>(1), model, rng, 100),
+                    std::invalid_argument);
+  REQUIRE(!std::filesystem::exists(filename));
+}
+
+TEST_CASE("ThreadPool bulk tasks and latches", "[ThreadPool]"){
+  ThreadPool* pool = ThreadPool::get_instance();
+  pool->stop();
+  pool->start(3);
+  REQUIRE(pool->number_of_threads() == 3);
+
+  std::vector<int> hits(10000, 0);
+  auto task = [&](const size_t i){ hits[i] += 1; };
+  TaskLatch done;
+  pool->spawn_bulk(hits.size(), task, done);
+  pool->wait(done);
+  REQUIRE(done.ready());
+  REQUIRE(std::all_of(hits.begin(), hits.end(), [](int h){ return h == 1; }));
+
+  // the old future based api still works on top of the inline tasks
+  auto fut = pool->spawn_task([](){ return true; });
+  pool->active_wait(fut);
+  REQUIRE(fut.get());
+
+  // generators are positioned absolutely, so the parallel engine reproduces the sequential one exactly
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng;
+  REQUIRE(parallel_monte_carlo_simulation(call, model, rng, 5000) == monte_carlo_simulation(call, model, rng, 5000));
+
+  // threads outside the pool all share thread number 0, concurrent callers must still not run each others tasks
+  const auto expected = monte_carlo_simulation(call, model, rng, 20000);
+  std::vector<std::vector<std::vector<double>>> results(4);
+  std::vector<std::thread> callers;
+  for(auto& result : results)
+    callers.emplace_back([&](){ result = parallel_monte_carlo_simulation(call, model, rng, 20000); });
+  for(auto& caller : callers) caller.join();
+  for(const auto& result : results) REQUIRE(result == expected);
+}
+
+TEST_CASE("ThreadPool placement and topology", "[ThreadPool]"){
+  ThreadPool* pool = ThreadPool::get_instance();
+  pool->stop();
+  pool->start(4, ThreadPlacement::scatter);
+
+  const auto& topology = pool->topology();
+  REQUIRE(topology.number_of_nodes() >= 1);
+  REQUIRE(topology.number_of_cpus() >= 1);
+
+  // every pinned worker sits on a cpu the topology knows about, and every thread belongs to exactly one node
+  size_t counted = 0;
+  for(size_t node = 0; node < topology.number_of_nodes(); ++node) counted += pool->threads_on_node(node).size();
+  REQUIRE(counted == pool->number_of_threads() + 1);
+  REQUIRE(pool->cpu_of_thread(0) == -1);
+  for(size_t i = 1; i <= pool->number_of_threads(); ++i){
+    REQUIRE(pool->cpu_of_thread(i) >= 0);
+    REQUIRE(pool->node_of_thread(i) == topology.node_of_cpu(pool->cpu_of_thread(i)));
+  }
+
+  // pinning does not change the numbers
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng;
+  REQUIRE(parallel_monte_carlo_simulation(call, model, rng, 5000) == monte_carlo_simulation(call, model, rng, 5000));
+
+  pool->stop();
+  pool->start(3, ThreadPlacement::compact);
+  REQUIRE(pool->number_of_threads() == 3);
+}
+
+TEST_CASE("Pricing scheduler futures, progress and cancellation", "[PricingScheduler]"){
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  EuropeanCall<double> otm_call{120.0, 1.0};
+  MersenneTwistRNG rng;
+  PricingScheduler scheduler;
+
+  size_t progress_calls = 0;
+  size_t last_paths_done = 0;
+  bool monotonic = true;
+  PricingConfig config;
+  config.num_paths = 20000;
+  config.chunk_size = 1000;
+  config.on_progress = [&](const PricingEstimate& estimate){
+    ++progress_calls;
+    monotonic = monotonic && estimate.paths_done > last_paths_done;
+    last_paths_done = estimate.paths_done;
+  };
+
+  // two jobs share the workers, the urgent one at a higher priority
+  PricingConfig urgent;
+  urgent.num_paths = 20000;
+  urgent.chunk_size = 500;
+  urgent.priority = 10;
+
+  auto future = scheduler.submit(call, model, rng, config);
+  auto urgent_future = scheduler.submit(otm_call, model, rng, urgent);
+
+  // the chunks are combined in order, so the result matches the sequential engine up to summation order
+  auto expected = [&](const EuropeanCall<double>& instrument){
+    auto paths = monte_carlo_simulation(instrument, model, rng, 20000);
+    return std::accumulate(paths.begin(), paths.end(), 0.0, [](auto acc, auto v){ return acc + v[0]; }) / 20000;
+  };
+  const auto result = future.get();
+  REQUIRE(!result.cancelled);
+  REQUIRE(result.paths_done == 20000);
+  REQUIRE(std::abs(result.mean[0] - expected(call)) <= 1e-9);
+  REQUIRE(result.standard_error[0] > 0.0);
+  REQUIRE(progress_calls == 20);
+  REQUIRE(monotonic);
+  REQUIRE(last_paths_done == 20000);
+
+  const auto urgent_result = urgent_future.get();
+  REQUIRE(std::abs(urgent_result.mean[0] - expected(otm_call)) <= 1e-9);
+
+  // a cancelled job stops handing out chunks and reports what it got through
+  PricingConfig big;
+  big.num_paths = 10000000;
+  big.chunk_size = 100;
+  auto cancelled = scheduler.submit(call, model, rng, big);
+  cancelled.cancel();
+  const auto partial = cancelled.get();
+  REQUIRE(partial.cancelled);
+  REQUIRE(partial.paths_done < big.num_paths);
+  REQUIRE(cancelled.ready());
+
+  // chunks that are not a multiple of the path block still cover every path exactly once
+  PricingConfig ragged;
+  ragged.num_paths = 20000;
+  ragged.chunk_size = 300;
+  REQUIRE(std::abs(scheduler.submit(call, model, rng, ragged).get().mean[0] - expected(call)) <= 1e-9);
+
+  // a future may outlive its scheduler, the scheduler cancels its jobs on the way out
+  std::vector<PricingFuture> orphans;
+  {
+    PricingScheduler short_lived;
+    orphans.push_back(short_lived.submit(call, model, rng, big));
+  }
+  const auto orphan = orphans[0].get();
+  REQUIRE(orphans[0].ready());
+  REQUIRE(orphan.paths_done <= big.num_paths);
+  REQUIRE(orphan.paths_done % big.chunk_size == 0);
+}
+
+TEST_CASE("Pricing server answers over its socket", "[PricingServer]"){
+  const auto socket_path = (std::filesystem::temp_directory_path() / "mclib_pricing_test.sock").string();
+  PricingServer server(socket_path);
+  std::thread accept_loop([&](){ server.run(); });
+
+  PricingRequest request;
+  request.num_paths = 10000;
+  request.spot = 100.0;
+  request.vol = 0.2;
+  request.strike = 100.0;
+  request.expiration = 1.0;
+
+  // the server prices exactly what a local scheduler would
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng{42};
+  PricingScheduler scheduler;
+  PricingConfig config;
+  config.num_paths = 10000;
+  const auto local = scheduler.submit(call, model, rng, config).get();
+
+  {
+    PricingClient client(socket_path);
+    const auto response = client.price(request);
+    REQUIRE(response.status == PricingStatus::ok);
+    REQUIRE(response.paths_done == 10000);
+    REQUIRE(response.price == local.mean[0]);
+    REQUIRE(response.standard_error == local.standard_error[0]);
+
+    // a second request on the same connection moves the warm model's parameters
+    request.vol = 0.3;
+    const auto bumped = client.price(request);
+    REQUIRE(bumped.status == PricingStatus::ok);
+    REQUIRE(bumped.price > response.price);
+
+    request.vol = -1.0;
+    REQUIRE(client.price(request).status == PricingStatus::bad_request);
+    request.vol = 0.2;
+    request.rate = std::nan("");
+    REQUIRE(client.price(request).status == PricingStatus::bad_request);
+    request.rate = 0.0;
+    request.strike = std::numeric_limits<double>::infinity();
+    REQUIRE(client.price(request).status == PricingStatus::bad_request);
+    request.strike = 100.0;
+
+    // the whole 64 bit seed reaches the rng
+    request.seed = (std::uint64_t{1} << 32) + 42;
+    MersenneTwistRNG wide_seed{request.seed};
+    const auto wide = scheduler.submit(call, model, wide_seed, config).get();
+    const auto wide_response = client.price(request);
+    REQUIRE(wide_response.price == wide.mean[0]);
+    REQUIRE(wide_response.price != response.price);
+    request.seed = 42;
+
+    // pcg requests are priced on exactly the sequential engine's paths, whatever the chunking
+    request.rng = PricingRngKind::pcg;
+    PCGRNG pcg{42};
+    const auto pcg_paths = monte_carlo_simulation(call, model, pcg, 10000);
+    const double pcg_mean = std::accumulate(pcg_paths.begin(), pcg_paths.end(), 0.0,
+                                            [](double acc, const auto& r){ return acc + r[0]; }) / 10000;
+    const auto pcg_response = client.price(request);
+    REQUIRE(pcg_response.status == PricingStatus::ok);
+    REQUIRE(std::abs(pcg_response.price - pcg_mean) <= 1e-10);
+    REQUIRE(client.price(request).price == pcg_response.price);
+    request.rng = PricingRngKind::mersenne_twist;
+
+    // and no request gets more than the configured number of paths
+    request.num_paths = PricingServer::default_max_paths + 1;
+    REQUIRE(client.price(request).status == PricingStatus::bad_request);
+    request.num_paths = ~std::uint64_t{0};
+    REQUIRE(client.price(request).status == PricingStatus::bad_request);
+  }
+
+  server.request_stop();
+  accept_loop.join();
+}
+
+TEST_CASE("Scripted instruments", "[ScriptedInstrument]"){
+  BlackScholesModel<double> model{100.0, 0.2, 0.02};
+  MersenneTwistRNG rng;
+
+  // a scripted call is the same product as the hand written one
+  ScriptedInstrument<double> scripted_call{"K = 100\non 1.0: pay max(spot - K, 0)"};
+  EuropeanCall<double> call{100.0, 1.0};
+  REQUIRE(scripted_call.timeline() == call.timeline());
+  REQUIRE(scripted_call.samples_needed()[0].numeraire);
+  REQUIRE(monte_carlo_simulation(scripted_call, model, rng, 1000) == monte_carlo_simulation(call, model, rng, 1000));
+
+  // an up and out call with a rebate, the timeline and samples come from the event dates
+  ScriptedInstrument<double> barrier{R"(
+    # knocked out above B on any monitoring date
+    K = 100
+    B = 120
+    alive = 1
+    hits = 0
+    on 0.25: if spot >= B then alive = 0 hits += 1 end
+    on 0.5: if spot >= B then alive = 0 hits += 1 end
+    on 0.75: if not (spot < B) then alive = 0 hits += 1 end
+    on 1.0:
+      if alive and spot > K then pay spot - K
+      else if hits >= 2 then pay 2 else pay 1 end
+      end
+  )"};
+  REQUIRE(barrier.timeline() == std::vector<double>{0.25, 0.5, 0.75, 1.0});
+  REQUIRE(!barrier.samples_needed()[0].numeraire);
+  REQUIRE(barrier.samples_needed()[3].numeraire);
+
+  // the block evaluation agrees with a straightforward per path evaluation of the same rules
+  auto results = monte_carlo_simulation(barrier, model, rng, 1000);
+  auto cmodel = model.clone();
+  cmodel->allocate(barrier.timeline(), barrier.samples_needed());
+  cmodel->initialize(barrier.timeline(), barrier.samples_needed());
+  auto crng = rng.clone();
+  crng->initialize(cmodel->simulation_dimension());
+  std::vector<double> gaussians(cmodel->simulation_dimension());
+  Scenario<double> path;
+  allocate_path(barrier.samples_needed(), path);
+  for(size_t i = 0; i < 1000; ++i){
+    crng->get_gaussians(gaussians);
+    cmodel->generate_path(gaussians, path);
+    int hits = 0;
+    for(int e = 0; e < 3; ++e) hits += path[e].forwards[0] >= 120.0;
+    const double spot = path[3].forwards[0];
+    const double expected = (hits == 0 && spot > 100.0 ? spot - 100.0 : (hits >= 2 ? 2.0 : 1.0)) / path[3].numeraire;
+    REQUIRE(std::abs(results[i][0] - expected) <= 1e-12);
+
+    std::vector<double> single(1);
+    barrier.payoffs(path, single);
+    REQUIRE(single[0] == results[i][0]);
+  }
+
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: pay max(spot - K, 0)"});
+  REQUIRE_THROWS(ScriptedInstrument<double>{"K = 100\npay K"});
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: if spot > 1 then pay 1"});
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: pay 1\non 0.5: pay 1"});
+
+  // numbers are scanned as plain decimals with an optional exponent, nothing else strtod would take
+  ScriptedInstrument<double> exponents{"on 1.0: pay spot / 4e0 + 2.5E+1 * 1e-1"};
+  Scenario<double> sample;
+  allocate_path(exponents.samples_needed(), sample);
+  sample[0].forwards[0] = 10.0;
+  sample[0].numeraire = 2.0;
+  std::vector<double> owed(1);
+  exponents.payoffs(sample, owed);
+  REQUIRE(std::abs(owed[0] - (10.0 / 4.0 + 2.5) / 2.0) <= 1e-12);
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: pay 0x10"});
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: pay inf"});
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: pay nan"});
+  REQUIRE_THROWS(ScriptedInstrument<double>{"on 1.0: pay 1e"});
+}
+TEST_CASE("Merton jump model", "[FinancialModel]"){
+  REQUIRE(std::abs(merton_detail::inverse_normal_cdf(0.975) - 1.959963984540054) <= 1e-14);
+  REQUIRE(std::abs(merton_detail::inverse_normal_cdf(1e-10) + 6.361340902404056) <= 1e-12);
+
+  const double spot = 100.0, vol = 0.2, rate = 0.02, div = 0.01;
+  const double intensity = 1.0, jump_mean = -0.1, jump_vol = 0.15;
+  MertonJumpModel<double> model{spot, vol, rate, div, intensity, jump_mean, jump_vol};
+
+  // the semi analytic price, a poisson weighted sum of black scholes prices conditional on the number of jumps
+  auto black_scholes = [](double s, double k, double t, double r, double q, double v){
+    auto cdf = [](double x){ return 0.5 * std::erfc(-x / std::sqrt(2.0)); };
+    const double d1 = (std::log(s / k) + (r - q + 0.5 * v * v) * t) / (v * std::sqrt(t));
+    return s * std::exp(-q * t) * cdf(d1) - k * std::exp(-r * t) * cdf(d1 - v * std::sqrt(t));
+  };
+  auto merton = [&](double k, double t){
+    const double kappa = std::exp(jump_mean + 0.5 * jump_vol * jump_vol) - 1.0;
+    const double lambda = intensity * (1.0 + kappa);
+    double price = 0.0;
+    for(int n = 0; n < 60; ++n){
+      const double weight = std::exp(-lambda * t + n * std::log(lambda * t) - std::lgamma(n + 1.0));
+      const double r_n = rate - intensity * kappa + n * std::log(1.0 + kappa) / t;
+      const double v_n = std::sqrt(vol * vol + n * jump_vol * jump_vol / t);
+      price += weight * black_scholes(spot, k, t, r_n, div, v_n);
+    }
+    return price;
+  };
+
+  auto check = [&](const Instrument<double>& instrument, const double expected, const size_t num_paths){
+    MersenneTwistRNG rng;
+    const auto results = monte_carlo_simulation(instrument, model, rng, num_paths);
+    double sum = 0.0, sum_sq = 0.0;
+    for(const auto& r : results){ sum += r[0]; sum_sq += r[0] * r[0]; }
+    const double mean = sum / num_paths;
+    const double standard_error = std::sqrt((sum_sq / num_paths - mean * mean) / num_paths);
+    REQUIRE(std::abs(mean - expected) <= 4.0 * standard_error);
+  };
+
+  // one step, so several jumps can land in the same step
+  check(EuropeanCall<double>{90.0, 1.0}, merton(90.0, 1.0), 400000);
+  // monthly steps with only the last date paying, the same price through many small poisson steps
+  check(ScriptedInstrument<double>{R"(
+    on 0.0833333333: on 0.1666666667: on 0.25: on 0.3333333333: on 0.4166666667: on 0.5:
+    on 0.5833333333: on 0.6666666667: on 0.75: on 0.8333333333: on 0.9166666667:
+    on 1.0: pay max(spot - 110, 0)
+  )"}, merton(110.0, 1.0), 200000);
+
+  // bumping the jump parameters through the public pointers reprices like a fresh model
+  EuropeanCall<double> call{100.0, 1.0};
+  model.allocate(call.timeline(), call.samples_needed());
+  model.initialize(call.timeline(), call.samples_needed());
+  REQUIRE(model.simulation_dimension() == 3);
+  auto& params = model.parameters();
+  *params[4] = 3.0;
+  *params[5] = 0.05;
+  model.initialize(call.timeline(), call.samples_needed());
+  MertonJumpModel<double> fresh{spot, vol, rate, div, 3.0, 0.05, jump_vol};
+  fresh.allocate(call.timeline(), call.samples_needed());
+  fresh.initialize(call.timeline(), call.samples_needed());
+
+  // a count draw of -0.5 is two jumps at intensity 3, P(N <= 1) < N(-0.5) < P(N <= 2)
+  std::vector<double> gaussians{0.3, -0.5, -0.7};
+  Scenario<double> path, fresh_path;
+  allocate_path(call.samples_needed(), path);
+  allocate_path(call.samples_needed(), fresh_path);
+  model.generate_path(gaussians, path);
+  fresh.generate_path(gaussians, fresh_path);
+  REQUIRE(path[0].forwards == fresh_path[0].forwards);
+
+  const double kappa = std::exp(0.05 + 0.5 * jump_vol * jump_vol) - 1.0;
+  const double expected = spot * std::exp((rate - div - 3.0 * kappa - 0.5 * vol * vol) + vol * 0.3 + 2 * 0.05 +
+                                          std::sqrt(2.0) * jump_vol * -0.7);
+  REQUIRE(std::abs(path[0].forwards[0] - expected) <= 1e-10);
+}
+
+TEST_CASE("Sharded simulation merges exactly", "[ShardedSimulation]"){
+  BlackScholesModel<double> model{100.0, 0.2};
+  EuropeanCall<double> call{100.0, 1.0};
+  MersenneTwistRNG rng;
+  const size_t num_paths = 10000;
+  const size_t block_size = 512;
+
+  const auto whole = merge_shard_snapshots({simulate_shard(call, model, rng, num_paths, 0, num_paths, block_size)});
+  REQUIRE(whole.paths_done == num_paths);
+
+  // same paths as the sequential engine, only summed in blocks
+  const auto results = monte_carlo_simulation(call, model, rng, num_paths);
+  const double mean = std::accumulate(results.begin(), results.end(), 0.0,
+                                      [](double acc, const auto& r){ return acc + r[0]; }) / num_paths;
+  REQUIRE(std::abs(whole.mean[0] - mean) <= 1e-10);
+
+  // three shards written to disk and merged out of order give the same bits
+  std::vector<std::string> files;
+  for(size_t s = 0; s < 3; ++s){
+    const auto [first, last] = shard_range(num_paths, s, 3, block_size);
+    files.push_back((std::filesystem::temp_directory_path() / ("mclib_shard_" + std::to_string(s) + ".snap")).string());
+    write_shard_snapshot(files.back(), simulate_shard(call, model, rng, num_paths, first, last, block_size));
+  }
+  std::vector<ShardSnapshot> shards{read_shard_snapshot(files[2]), read_shard_snapshot(files[0]), read_shard_snapshot(files[1])};
+  const auto merged = merge_shard_snapshots(shards);
+  REQUIRE(merged.mean == whole.mean);
+  REQUIRE(merged.standard_error == whole.standard_error);
+
+  // pcg shards jump exactly too, they merge to the bits of the whole run and match the sequential engine
+  PCGRNG pcg{11};
+  const auto pcg_whole = merge_shard_snapshots({simulate_shard(call, model, pcg, num_paths, 0, num_paths, block_size)});
+  std::vector<ShardSnapshot> pcg_shards;
+  for(size_t s = 0; s < 3; ++s){
+    const auto [first, last] = shard_range(num_paths, s, 3, block_size);
+    pcg_shards.push_back(simulate_shard(call, model, pcg, num_paths, first, last, block_size));
+  }
+  REQUIRE(merge_shard_snapshots(pcg_shards).mean == pcg_whole.mean);
+  const auto pcg_results = monte_carlo_simulation(call, model, pcg, num_paths);
+  const double pcg_mean = std::accumulate(pcg_results.begin(), pcg_results.end(), 0.0,
+                                          [](double acc, const auto& r){ return acc + r[0]; }) / num_paths;
+  REQUIRE(std::abs(pcg_whole.mean[0] - pcg_mean) <= 1e-10);
+
+  // gaps, different runs and misaligned boundaries are refused
+  REQUIRE_THROWS(merge_shard_snapshots({shards[0], shards[1]}));
+  BlackScholesModel<double> other{100.0, 0.25};
+  auto foreign = simulate_shard(call, other, rng, num_paths, shards[2].first_path, shards[2].last_path, block_size);
+  REQUIRE_THROWS(merge_shard_snapshots({shards[1], shards[2], foreign}));
+  REQUIRE_THROWS(simulate_shard(call, model, rng, num_paths, 100, 1024, block_size));
+
+  // a header promising more than the file holds is refused before anything is allocated
+  auto corrupt = [&](const size_t offset, const std::uint64_t value){
+    std::fstream file(files[0], std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  corrupt(offsetof(shard_detail::Header, key_size), std::uint64_t(1) << 62);
+  REQUIRE_THROWS(read_shard_snapshot(files[0]));
+  corrupt(offsetof(shard_detail::Header, key_size), shards[1].key.size());
+  corrupt(offsetof(shard_detail::Header, number_of_payoffs), std::uint64_t(1) << 61);
+  REQUIRE_THROWS(read_shard_snapshot(files[0]));
+  corrupt(offsetof(shard_detail::Header, number_of_payoffs), 2);
+  REQUIRE_THROWS(read_shard_snapshot(files[0]));
+  corrupt(offsetof(shard_detail::Header, number_of_payoffs), 1);
+  REQUIRE(read_shard_snapshot(files[0]).sums == shards[1].sums);
+  for(const auto& file : files) std::filesystem::remove(file);
+}
+
+TEST_CASE("Calibration to a quote surface", "[Calibration]"){
+  MersenneTwistRNG rng;
+  std::vector<CalibrationQuote> quotes;
+  for(const double expiration : {0.5, 1.0, 2.0})
+    for(const double strike : {80.0, 90.0, 100.0, 110.0, 120.0})
+      quotes.push_back({EuropeanCall<double>{strike, expiration}, 0.0});
+
+  CalibrationConfig config;
+  config.num_paths = 20000;
+
+  // quotes priced by the calibrator's own paths are recovered exactly, there is no monte carlo noise left
+  // between the objective and its minimum
+  BlackScholesModel<double> truth{100.0, 0.25, 0.02, 0.03};
+  CalibrationPricer pricer(quotes, truth, rng, config);
+  const auto prices = pricer.price({1, 3}, {{0.25, 0.03}})[0];
+  for(size_t q = 0; q < quotes.size(); ++q) quotes[q].price = prices[q];
+
+  // parameters a call does not set come from the pricers model, not from whatever the previous call left behind
+  pricer.price({1}, {{0.4}, {0.5}});
+  REQUIRE(pricer.price({3}, {{0.03}})[0] == prices);
+
+  // with a single expiry the strip uses the same draws as the engine pricing each call on its own
+  std::vector<CalibrationQuote> one_expiry(quotes.begin(), quotes.begin() + 5);
+  const auto one_expiry_prices = CalibrationPricer(one_expiry, truth, rng, config).price({1}, {{0.25}})[0];
+  for(size_t q = 0; q < one_expiry.size(); ++q){
+    const auto results = monte_carlo_simulation(one_expiry[q].call, truth, rng, config.num_paths);
+    const double mean = std::accumulate(results.begin(), results.end(), 0.0,
+                                        [](double acc, const auto& r){ return acc + r[0]; }) / config.num_paths;
+    REQUIRE(std::abs(mean - one_expiry_prices[q]) <= 1e-9);
+  }
+
+  BlackScholesModel<double> guess{100.0, 0.15, 0.02, 0.0};
+  const auto result = calibrate(quotes, guess, rng, {{1, 0.01, 2.0}, {3, -0.2, 0.2}}, config);
+  REQUIRE(result.converged);
+  REQUIRE(result.iterations > 0);
+  // every priced point comes with its two bumps, the last iteration stops before pricing its tiny step
+  REQUIRE(result.evaluations % 3 == 0);
+  REQUIRE(result.evaluations <= 3 * (result.iterations + 1));
+  REQUIRE(result.wall_seconds > 0.0);
+  REQUIRE(std::abs(result.parameters[0] - 0.25) <= 1e-6);
+  REQUIRE(std::abs(result.parameters[1] - 0.03) <= 1e-6);
+  REQUIRE(result.rms_error <= 1e-8);
+
+  // with the true vol out of bounds it ends up stuck on the bound, which is not convergence
+  const auto boxed = calibrate(quotes, guess, rng, {{1, 0.01, 0.2}, {3, -0.2, 0.2}}, config);
+  REQUIRE_FALSE(boxed.converged);
+  REQUIRE(boxed.parameters[0] == 0.2);
+  REQUIRE(boxed.iterations < config.max_iterations);
+
+  // the merton model through the same routine, its diffusion vol against quotes from a known model
+  MertonJumpModel<double> merton_truth{100.0, 0.18, 0.02, 0.0, 0.5, -0.1, 0.15};
+  CalibrationPricer merton_pricer(quotes, merton_truth, rng, config);
+  const auto merton_prices = merton_pricer.price({1}, {{0.18}})[0];
+  for(size_t q = 0; q < quotes.size(); ++q) quotes[q].price = merton_prices[q];
+  MertonJumpModel<double> merton_guess{100.0, 0.3, 0.02, 0.0, 0.5, -0.1, 0.15};
+  const auto merton = calibrate(quotes, merton_guess, rng, {{1, 0.01, 2.0}}, config);
+  REQUIRE(std::abs(merton.parameters[0] - 0.18) <= 1e-6);
+}
+
+TEST_CASE("Streaming path dependent instruments", "[StreamingInstrument]"){
+  std::vector<double> monthly;
+  for(int i = 1; i <= 12; ++i) monthly.push_back(i / 12.0);
+
+  BlackScholesModel<double> model{100.0, 0.2, 0.02};
+  MertonJumpModel<double> merton{100.0, 0.2, 0.02, 0.0, 0.5, -0.1, 0.15};
+  MersenneTwistRNG rng;
+
+  ArithmeticAsianCall<double> arithmetic{100.0, monthly};
+  GeometricAsianCall<double> geometric{100.0, monthly};
+  LookbackCall<double> lookback{monthly};
+  Cliquet<double> cliquet{monthly, -0.02, 0.03, 0.0, 100.0};
+
+  // streaming the samples gives exactly what the scenario engine computes from whole paths
+  for(const StreamingInstrument<double>* instrument : std::vector<const StreamingInstrument<double>*>{&arithmetic, &geometric, &lookback, &cliquet}){
+    REQUIRE(streaming_monte_carlo_simulation(*instrument, model, rng, 1000) == monte_carlo_simulation(*instrument, model, rng, 1000));
+    REQUIRE(streaming_monte_carlo_simulation(*instrument, merton, rng, 1000) == monte_carlo_simulation(*instrument, merton, rng, 1000));
+  }
+
+  // and the running statistics match a second scan over the stored path
+  auto cmodel = model.clone();
+  cmodel->allocate(cliquet.timeline(), cliquet.samples_needed());
+  cmodel->initialize(cliquet.timeline(), cliquet.samples_needed());
+  auto crng = rng.clone();
+  crng->initialize(cmodel->simulation_dimension());
+  std::vector<double> gaussians(cmodel->simulation_dimension());
+  Scenario<double> path;
+  allocate_path(cliquet.samples_needed(), path);
+  std::vector<double> payoff(1);
+  for(int p = 0; p < 100; ++p){
+    crng->get_gaussians(gaussians);
+    cmodel->generate_path(gaussians, path);
+    double sum = 0.0, lowest = path[0].forwards[0], clamped = 0.0;
+    for(size_t i = 0; i < path.size(); ++i){
+      sum += path[i].forwards[0];
+      lowest = std::min(lowest, path[i].forwards[0]);
+      if(i > 0) clamped += std::clamp(path[i].forwards[0] / path[i - 1].forwards[0] - 1.0, -0.02, 0.03);
+    }
+    const double numeraire = path.back().numeraire;
+
+    arithmetic.payoffs(path, payoff);
+    REQUIRE(std::abs(payoff[0] - std::max(sum / 12.0 - 100.0, 0.0) / numeraire) <= 1e-12);
+    lookback.payoffs(path, payoff);
+    REQUIRE(std::abs(payoff[0] - (path.back().forwards[0] - lowest) / numeraire) <= 1e-12);
+    cliquet.payoffs(path, payoff);
+    REQUIRE(std::abs(payoff[0] - 100.0 * std::max(clamped, 0.0) / numeraire) <= 1e-12);
+  }
+
+  // the geometric asian has a closed form under black scholes, log of the average is gaussian
+  const double rate = 0.02, vol = 0.2, strike = 100.0, n = 12.0;
+  double mean_time = 0.0, variance = 0.0;
+  for(const double t : monthly) mean_time += t / n;
+  for(const double s : monthly) for(const double t : monthly) variance += vol * vol * std::min(s, t) / (n * n);
+  const double m = std::log(100.0) + (rate - 0.5 * vol * vol) * mean_time;
+  const double d2 = (m - std::log(strike)) / std::sqrt(variance);
+  auto cdf = [](double x){ return 0.5 * std::erfc(-x / std::sqrt(2.0)); };
+  const double expected = std::exp(-rate) * (std::exp(m + 0.5 * variance) * cdf(d2 + std::sqrt(variance)) - strike * cdf(d2));
+
+  const size_t num_paths = 200000;
+  const auto results = streaming_monte_carlo_simulation(geometric, model, rng, num_paths);
+  double total = 0.0, total_sq = 0.0;
+  for(const auto& r : results){ total += r[0]; total_sq += r[0] * r[0]; }
+  const double mean = total / num_paths;
+  const double standard_error = std::sqrt((total_sq / num_paths - mean * mean) / num_paths);
+  REQUIRE(std::abs(mean - expected) <= 4.0 * standard_error);
+
+  REQUIRE_THROWS(LookbackCall<double>{{0.5, 0.25}});
+  REQUIRE_THROWS(ArithmeticAsianCall<double>{100.0, {0.0, 1.0}});
+  REQUIRE_THROWS(Cliquet<double>{{1.0}, -0.02, 0.03, 0.0});
+}